@@ -31,6 +31,7 @@ either expressed or implied, of copyright holders.
 #pragma once
 
 #include <boost/noncopyable.hpp>
+#include <boost/chrono/chrono.hpp>
 #include <typeinfo>
 #include <compat/tr1_memory.h>
 #include <string>
@@ -42,6 +43,9 @@ namespace mxasync {
 class Message : private boost::noncopyable
 {
 public:
+  typedef boost::chrono::steady_clock Clock;
+  typedef Clock::time_point TimePoint;
+
   virtual ~Message() { }
 
   virtual std::string toString() const
@@ -49,9 +53,50 @@ public:
     return typeid(*this).name();
   }
 
+  // creation time, TimePoint() unless stamped by the producer
+  TimePoint getTimestamp() const { return timestamp; }
+
+  // TimePoint() means the message never expires
+  TimePoint getDeadline() const { return deadline; }
+  bool hasDeadline() const { return deadline != TimePoint(); }
+
+  bool isExpired() const
+  {
+    return hasDeadline() && Clock::now() >= deadline;
+  }
+
+  bool isExpired(TimePoint now) const
+  {
+    return hasDeadline() && now >= deadline;
+  }
+
+  // producer side: invoke before the message is pushed anywhere,
+  // published messages are shared and must not change
+  void stamp(TimePoint t = Clock::now())
+  {
+    timestamp = t;
+  }
+
+  void setDeadline(TimePoint d)
+  {
+    deadline = d;
+  }
+
+  // deadline relative to the creation time; stamps the message if needed
+  void setMaxAge(unsigned milliseconds)
+  {
+    if (timestamp == TimePoint())
+      stamp();
+    deadline = timestamp + boost::chrono::milliseconds(milliseconds);
+  }
+
 protected:
   Message()
   { }
+
+private:
+  TimePoint timestamp;
+  TimePoint deadline;
 };
 
 typedef std::tr1::shared_ptr<const Message> PMessage;
@@ -64,6 +109,15 @@ inline std::tr1::shared_ptr<const T> msg_cast(PMessage const& m)
   return std::tr1::dynamic_pointer_cast<const T>(m);
 }
 
+// predicate for Queue<PMessage>::pop_fresh() and friends
+struct IsExpiredMessage
+{
+  bool operator () (PMessage const& m) const
+  {
+    return m && m->isExpired();
+  }
+};
+
 class BadMessage : public std::exception
 {
 public:
@@ -0,0 +1,218 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+
+#include <mxasync/actor.hpp>
+#include <mxasync/mq.hpp>
+#include <boost/chrono/chrono.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+
+namespace mxasync {
+
+// An actor that processes messages in batches. It waits for a message,
+// then gathers more until the batch reaches the target size or the latency
+// budget of its first message runs out, and hands them to processBatch().
+//
+// The target size follows the arrival rate: it is the number of messages
+// expected to arrive within the budget, so that a batch usually fills just
+// as the budget ends. Under light load batches shrink to a single message
+// processed right away; under heavy load, or with a backlog, they grow up
+// to maxBatch. Messages stamped by the producer (see Message::stamp) have
+// their budget counted from the stamp and their arrival rate measured by it.
+//
+// run() returns after a StopMessage, the messages before it are processed.
+//
+//   class Encoder : public BatchingActor
+//   {
+//   public:
+//     Encoder(PMessageInput const& in) : BatchingActor(in) { }
+//   protected:
+//     virtual void processBatch(std::vector<PMessage> const& batch) { ... }
+//   };
+class BatchingActor : public Actor
+{
+public:
+  typedef Message::Clock Clock;
+
+  struct Options
+  {
+    size_t minBatch;          // bounds of the batch size
+    size_t maxBatch;
+    unsigned latencyBudgetMs; // longest wait for more messages
+    bool adaptive;            // otherwise batches always aim at maxBatch
+    bool dropExpired;         // skip messages past their deadline, see Message::setDeadline
+
+    Options()
+    : minBatch(1),
+      maxBatch(32),
+      latencyBudgetMs(10),
+      adaptive(true),
+      dropExpired(false)
+    { }
+  };
+
+  struct Stats
+  {
+    unsigned long batches;
+    unsigned long messages;
+    unsigned long timedOut;   // batches closed by the budget before reaching the target
+    size_t targetBatch;       // current target size
+    double arrivalRate;       // messages per second, 0 until measured
+
+    Stats()
+    : batches(0),
+      messages(0),
+      timedOut(0),
+      targetBatch(0),
+      arrivalRate(0)
+    { }
+  };
+
+  explicit BatchingActor(PMessageInput const& input, Options const& options = Options())
+  : input(input),
+    options(options),
+    interval(0),
+    target(options.maxBatch)
+  {
+    if (!input)
+      throw std::invalid_argument("null input");
+    if (options.minBatch == 0 || options.maxBatch < options.minBatch)
+      throw std::invalid_argument("bad batch size bounds");
+    stats.targetBatch = target;
+  }
+
+  Stats getStats() const
+  {
+    boost::lock_guard<boost::mutex> lock(statsMutex);
+    return stats;
+  }
+
+protected:
+  // messages in the order of arrival, at least one
+  virtual void processBatch(std::vector<PMessage> const& batch) = 0;
+
+  virtual bool isStop(PMessage const& m) const
+  {
+    return static_cast<bool>(msg_cast<StopMessage>(m));
+  }
+
+  virtual void run()
+  {
+    std::vector<PMessage> batch;
+    batch.reserve(options.maxBatch);
+    for (;;)
+    {
+      batch.clear();
+      PMessage m = options.dropExpired ? input->popFresh() : input->pop();
+      if (isStop(m))
+        return;
+      Clock::time_point const first = arrived(m);
+      Clock::time_point const deadline = first + boost::chrono::milliseconds(options.latencyBudgetMs);
+      batch.push_back(m);
+
+      bool stopped = false, timedOut = false;
+      while (batch.size() < target)
+      {
+        Clock::time_point const now = Clock::now();
+        // the queued messages are taken even if the budget is gone
+        unsigned const left = now < deadline
+            ? unsigned(boost::chrono::duration_cast<boost::chrono::milliseconds>(deadline - now).count())
+            : 0;
+        bool const got = options.dropExpired ? input->timedPopFresh(m, left) : input->timedPop(m, left);
+        if (!got)
+        {
+          timedOut = true;
+          break;
+        }
+        if (isStop(m))
+        {
+          stopped = true;
+          break;
+        }
+        arrived(m);
+        batch.push_back(m);
+      }
+
+      processBatch(batch);
+      {
+        boost::lock_guard<boost::mutex> lock(statsMutex);
+        stats.batches++;
+        stats.messages += batch.size();
+        if (timedOut)
+          stats.timedOut++;
+        stats.targetBatch = target;
+        stats.arrivalRate = interval > 0 ? 1 / interval : 0;
+      }
+      if (stopped)
+        return;
+    }
+  }
+
+private:
+  // notes the arrival of m, updating the rate and the target batch size
+  // @return the time m arrived
+  Clock::time_point arrived(PMessage const& m)
+  {
+    Clock::time_point const now = Clock::now();
+    Clock::time_point t = m ? m->getTimestamp() : Clock::time_point();
+    if (t == Clock::time_point() || t > now)
+      t = now;
+    if (last != Clock::time_point() && t >= last)
+    {
+      // moving average of the time between messages, in seconds
+      double const dt = boost::chrono::duration<double>(t - last).count();
+      interval = interval > 0 ? interval + (dt - interval) / 8 : dt;
+    }
+    if (t > last)
+      last = t;
+    if (options.adaptive)
+    {
+      double const expected = interval > 0 ? options.latencyBudgetMs * 1e-3 / interval : double(options.maxBatch);
+      target = std::max(options.minBatch, size_t(std::min(expected + 0.5, double(options.maxBatch))));
+    }
+    return t;
+  }
+
+  PMessageInput const input;
+  Options const options;
+  Clock::time_point last;   // latest arrival
+  double interval;          // average time between arrivals, seconds
+  size_t target;
+  mutable boost::mutex statsMutex;
+  Stats stats;
+};
+
+} // namespace mxasync
@@ -0,0 +1,387 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <compat/tr1_memory.h>
+#include <mxasync/base_messages.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _MSC_VER
+# include <malloc.h>
+#else
+# include <unistd.h>
+#endif
+#ifdef __linux__
+# include <sys/mman.h>
+#endif
+
+
+namespace mxasync {
+
+// A chunk of aligned memory owned by a BufferPool.
+// Instances are only handed out wrapped into PBuffer; when the last
+// reference drops, the memory goes back to the pool instead of the heap.
+class Buffer : private boost::noncopyable
+{
+public:
+  unsigned char       * data()       { return storage; }
+  unsigned char const * data() const { return storage; }
+
+  // size requested by the last acquire()
+  size_t size() const { return used; }
+
+  // actual size of the allocation (size class of the buffer)
+  size_t capacity() const { return allocated; }
+
+private:
+  friend class BufferPool;
+
+  Buffer(unsigned char *storage, size_t allocated)
+  : storage(storage),
+    allocated(allocated),
+    used(0)
+  { }
+
+  unsigned char *storage;
+  size_t allocated;
+  size_t used;
+};
+
+typedef std::tr1::shared_ptr<Buffer> PBuffer;
+
+
+struct BufferPoolOptions
+{
+  size_t alignment;          // power of two, 64 suits AVX-512 loads
+  size_t minCapacity;        // smallest size class
+  size_t maxCachedPerClass;  // free buffers kept per size class
+  bool   prefault;           // touch pages on allocation to avoid faults later
+  bool   hugePages;          // advise transparent huge pages for large buffers (linux only)
+
+  BufferPoolOptions()
+  : alignment(64),
+    minCapacity(4096),
+    maxCachedPerClass(16),
+    prefault(false),
+    hugePages(false)
+  { }
+};
+
+
+// Size-classed pool of aligned buffers.
+// Size classes grow geometrically in quarter steps, so a buffer wastes
+// at most 25% of its capacity. Thread-safe.
+class BufferPool : private boost::noncopyable
+{
+public:
+  struct Stats
+  {
+    size_t hits;         // acquire() served from the cache
+    size_t misses;       // acquire() that had to allocate
+    size_t cached;       // buffers currently waiting in the cache
+    size_t cachedBytes;
+
+    Stats()
+    : hits(0), misses(0), cached(0), cachedBytes(0)
+    { }
+  };
+
+  explicit BufferPool(BufferPoolOptions const& options = BufferPoolOptions())
+  : state(new State(options))
+  {
+    if (options.alignment == 0 || (options.alignment & (options.alignment - 1)) != 0)
+      throw std::invalid_argument("BufferPool: alignment must be a power of two");
+  }
+
+  // Cached buffers are freed with the shared state, once buffers still
+  // referenced elsewhere are gone or have been freed by their deleters.
+  ~BufferPool()
+  { }
+
+  // @return a buffer of at least `size` bytes; contents are unspecified
+  PBuffer acquire(size_t size)
+  {
+    size_t const cap = capacityFor(size, state->options.minCapacity);
+    Buffer *b = 0;
+    {
+      boost::lock_guard<boost::mutex> g(state->mutex);
+      std::vector<Buffer *> & freeList = state->freeLists[cap];
+      if (!freeList.empty())
+      {
+        b = freeList.back();
+        freeList.pop_back();
+        state->stats.hits++;
+        state->stats.cached--;
+        state->stats.cachedBytes -= cap;
+      }
+      else
+        state->stats.misses++;
+    }
+    if (!b)
+      b = allocate(state->options, cap);
+    b->used = size;
+    return PBuffer(b, Recycler(state));
+  }
+
+  // pre-populate the cache, e.g. at startup, so the first frames
+  // do not pay for allocation and page faults
+  void reserve(size_t size, size_t count)
+  {
+    std::vector<PBuffer> held;
+    held.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+      held.push_back(acquire(size));
+  }
+
+  // release all cached buffers to the system
+  void trim()
+  {
+    boost::lock_guard<boost::mutex> g(state->mutex);
+    for (freelists_t::iterator it = state->freeLists.begin(); it != state->freeLists.end(); ++it)
+    {
+      for (size_t i = 0; i < it->second.size(); ++i)
+        release(it->second[i]);
+      it->second.clear();
+    }
+    state->stats.cached = 0;
+    state->stats.cachedBytes = 0;
+  }
+
+  Stats getStats() const
+  {
+    boost::lock_guard<boost::mutex> g(state->mutex);
+    return state->stats;
+  }
+
+  static size_t capacityFor(size_t size, size_t minCapacity)
+  {
+    if (size <= minCapacity)
+      return minCapacity;
+    size_t base = minCapacity;
+    while (base * 2 < size)
+      base *= 2;
+    size_t const step = base / 4 ? base / 4 : 1;
+    return base + (size - base + step - 1) / step * step;
+  }
+
+private:
+  typedef std::map<size_t, std::vector<Buffer *> > freelists_t;
+
+  // shared with outstanding buffers so that they may outlive the pool
+  struct State
+  {
+    State(BufferPoolOptions const& options)
+    : options(options)
+    { }
+
+    // also frees buffers recycled while the pool was being destroyed
+    ~State()
+    {
+      for (freelists_t::iterator it = freeLists.begin(); it != freeLists.end(); ++it)
+        for (size_t i = 0; i < it->second.size(); ++i)
+          release(it->second[i]);
+    }
+
+    BufferPoolOptions const options;
+    boost::mutex mutex;
+    freelists_t freeLists;
+    Stats stats;
+  };
+
+  struct Recycler
+  {
+    std::tr1::weak_ptr<State> state;
+
+    Recycler(std::tr1::shared_ptr<State> const& state)
+    : state(state)
+    { }
+
+    void operator () (Buffer *b) const
+    {
+      std::tr1::shared_ptr<State> s = state.lock();
+      if (s)
+      {
+        boost::lock_guard<boost::mutex> g(s->mutex);
+        std::vector<Buffer *> & freeList = s->freeLists[b->capacity()];
+        if (freeList.size() < s->options.maxCachedPerClass)
+        {
+          freeList.push_back(b);
+          s->stats.cached++;
+          s->stats.cachedBytes += b->capacity();
+          return;
+        }
+      }
+      release(b);
+    }
+  };
+
+  static Buffer * allocate(BufferPoolOptions const& options, size_t capacity)
+  {
+    size_t alignment = options.alignment;
+#ifdef __linux__
+    size_t const hugePageSize = size_t(2) << 20;
+    if (options.hugePages && capacity >= hugePageSize && alignment < hugePageSize)
+      alignment = hugePageSize;
+#endif
+
+    void *p = 0;
+#ifdef _MSC_VER
+    p = _aligned_malloc(capacity, alignment);
+#else
+    if (alignment < sizeof(void *))
+      alignment = sizeof(void *);
+    if (posix_memalign(&p, alignment, capacity) != 0)
+      p = 0;
+#endif
+    if (!p)
+      throw std::bad_alloc();
+
+#ifdef __linux__
+    if (options.hugePages && capacity >= hugePageSize)
+      madvise(p, capacity, MADV_HUGEPAGE);
+#endif
+
+    if (options.prefault)
+    {
+      unsigned char *bytes = static_cast<unsigned char *>(p);
+      size_t const page = pageSize();
+      for (size_t i = 0; i < capacity; i += page)
+        bytes[i] = 0;
+    }
+
+    try
+    {
+      return new Buffer(static_cast<unsigned char *>(p), capacity);
+    }
+    catch (...)
+    {
+      freeStorage(p);
+      throw;
+    }
+  }
+
+  static void release(Buffer *b)
+  {
+    freeStorage(b->storage);
+    delete b;
+  }
+
+  static void freeStorage(void *p)
+  {
+#ifdef _MSC_VER
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+
+  static size_t pageSize()
+  {
+#ifdef _MSC_VER
+    return 4096;
+#else
+    long const s = sysconf(_SC_PAGESIZE);
+    return s > 0 ? size_t(s) : 4096;
+#endif
+  }
+
+  std::tr1::shared_ptr<State> state;
+};
+
+typedef std::tr1::shared_ptr<BufferPool> PBufferPool;
+
+
+// Message referring to a part of a pooled buffer.
+// Fan-out through MessageMulticaster shares the buffer between consumers,
+// it returns to the pool when the last consumer drops the message.
+class BufferMessage;
+DECLARE_PMESSAGE_TYPE(BufferMessage);
+class BufferMessage : public Message
+{
+public:
+  BufferMessage(PBuffer const& buffer)
+  : buffer(buffer),
+    offset(0),
+    length(buffer ? buffer->size() : 0)
+  {
+    if (!buffer)
+      throw std::invalid_argument("BufferMessage: null buffer");
+  }
+
+  BufferMessage(PBuffer const& buffer, size_t offset, size_t length)
+  : buffer(buffer),
+    offset(offset),
+    length(length)
+  {
+    if (!buffer)
+      throw std::invalid_argument("BufferMessage: null buffer");
+    if (offset > buffer->capacity() || length > buffer->capacity() - offset)
+      throw std::out_of_range("BufferMessage: view exceeds buffer");
+  }
+
+  static PBufferMessage create(PBuffer const& buffer)
+  {
+    return PBufferMessage(new BufferMessage(buffer));
+  }
+
+  static PBufferMessage create(PBuffer const& buffer, size_t offset, size_t length)
+  {
+    return PBufferMessage(new BufferMessage(buffer, offset, length));
+  }
+
+  unsigned char const * data() const { return buffer->data() + offset; }
+  size_t size() const { return length; }
+
+  PBuffer const& getBuffer() const { return buffer; }
+
+  virtual std::string toString() const
+  {
+    std::ostringstream oss;
+    oss << "BufferMessage: " << length << " bytes";
+    return oss.str();
+  }
+
+private:
+  PBuffer const buffer;
+  size_t const offset;
+  size_t const length;
+};
+
+
+} // namespace mxasync
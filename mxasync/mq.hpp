@@ -35,6 +35,9 @@ either expressed or implied, of copyright holders.
 #include <boost/noncopyable.hpp>
 #include <mxasync/queue.hpp>
 #include <mxasync/base_messages.hpp>
+#include <boost/chrono/chrono.hpp>
+#include <boost/thread.hpp>
+#include <deque>
 #include <vector>
 #include <stdexcept>
 
@@ -52,9 +55,71 @@ public:
   virtual bool     timedPop(PMessage & m, unsigned milliseconds) = 0;
   virtual bool     timedPopMostRecent(PMessage & m, unsigned milliseconds) = 0;
 
+  // the *Fresh variants skip messages whose deadline has passed
+  // (see Message::setDeadline), they are never handed to the caller
+  virtual PMessage popFresh()
+  {
+    PMessage m;
+    do
+      m = pop();
+    while (IsExpiredMessage()(m));
+    return m;
+  }
+
+  virtual PMessage popMostRecentFresh()
+  {
+    PMessage m;
+    do
+      m = popMostRecent();
+    while (IsExpiredMessage()(m));
+    return m;
+  }
+
+  virtual bool timedPopFresh(PMessage & m, unsigned milliseconds)
+  {
+    return timedPopFreshImpl(m, milliseconds, &MessageInput::timedPop);
+  }
+
+  virtual bool timedPopMostRecentFresh(PMessage & m, unsigned milliseconds)
+  {
+    return timedPopFreshImpl(m, milliseconds, &MessageInput::timedPopMostRecent);
+  }
+
+  // number of expired messages skipped by the *Fresh pops,
+  // 0 if the input does not keep track of it
+  virtual unsigned long getDroppedCount() const
+  {
+    return 0;
+  }
+
 protected:
   MessageInput()
   { }
+
+private:
+  typedef bool (MessageInput::*TimedPopFn)(PMessage &, unsigned);
+
+  bool timedPopFreshImpl(PMessage & m, unsigned milliseconds, TimedPopFn timedPopFn)
+  {
+    typedef Message::Clock Clock;
+    Clock::time_point const until = Clock::now() + boost::chrono::milliseconds(milliseconds);
+    unsigned left = milliseconds;
+    for (;;)
+    {
+      PMessage x;
+      if (!(this->*timedPopFn)(x, left))
+        return false;
+      if (!IsExpiredMessage()(x))
+      {
+        m = x;
+        return true;
+      }
+      Clock::time_point const now = Clock::now();
+      if (now >= until)
+        return false;
+      left = unsigned(boost::chrono::duration_cast<boost::chrono::milliseconds>(until - now).count());
+    }
+  }
 };
 
 typedef std::tr1::shared_ptr<MessageInput> PMessageInput;
@@ -112,6 +177,31 @@ public:
     return queue.timed_pop_most_recent(m, milliseconds);
   }
 
+  virtual PMessage popFresh()
+  {
+    return queue.pop_fresh(IsExpiredMessage());
+  }
+
+  virtual PMessage popMostRecentFresh()
+  {
+    return queue.pop_most_recent_fresh(IsExpiredMessage());
+  }
+
+  virtual bool timedPopFresh(PMessage & m, unsigned milliseconds)
+  {
+    return queue.timed_pop_fresh(m, milliseconds, IsExpiredMessage());
+  }
+
+  virtual bool timedPopMostRecentFresh(PMessage & m, unsigned milliseconds)
+  {
+    return queue.timed_pop_most_recent_fresh(m, milliseconds, IsExpiredMessage());
+  }
+
+  virtual unsigned long getDroppedCount() const
+  {
+    return queue.dropped_count();
+  }
+
   void clear()
   {
     return queue.clear();
@@ -135,6 +225,226 @@ protected:
 typedef std::tr1::shared_ptr<MessageQueue> PMessageQueue;
 
 
+// Decouples a slow output from its producer: push() only buffers the
+// message, a thread of its own passes it on. When the buffer is full the
+// oldest messages are shed, and an output lagging too far behind can be
+// detached, after which everything pushed to it is dropped until
+// reattach(). A StopMessage is never dropped, even while detached, so
+// that the consumer behind the output still ends (see BatchingActor).
+//
+// The destructor discards what is still buffered, StopMessages aside, and
+// does not wait for the thread, since the output may block for good. A
+// push in progress finishes on its own, the StopMessages follow and the
+// thread then ends, keeping the output and the buffer state alive until
+// it does.
+class BufferedOutput : public MessageOutput
+{
+public:
+  typedef Message::Clock Clock;
+
+  struct Options
+  {
+    size_t capacity;         // buffered messages
+    unsigned maxLagMs;       // detach once the oldest buffered message waited longer, 0 for never
+    bool detachWhenFull;     // detach instead of shedding the oldest message
+
+    Options()
+    : capacity(64),
+      maxLagMs(0),
+      detachWhenFull(false)
+    { }
+  };
+
+  struct Stats
+  {
+    unsigned long pushed;
+    unsigned long delivered;
+    unsigned long dropped;   // shed, or pushed while detached; never a StopMessage
+    unsigned long detachments;
+    size_t queued;
+    double lagSeconds;       // age of the oldest buffered message
+    bool detached;
+
+    Stats()
+    : pushed(0),
+      delivered(0),
+      dropped(0),
+      detachments(0),
+      queued(0),
+      lagSeconds(0),
+      detached(false)
+    { }
+  };
+
+  explicit BufferedOutput(PMessageOutput const& out, Options const& options = Options())
+  : state(new State(out, options))
+  {
+    if (!out)
+      throw std::invalid_argument("null output");
+    if (options.capacity == 0)
+      throw std::invalid_argument("zero capacity");
+    thread = boost::thread(Deliver(state));
+  }
+
+  ~BufferedOutput()
+  {
+    {
+      boost::lock_guard<boost::mutex> lock(state->mutex);
+      state->stopping = true;
+      state->discard();
+    }
+    state->notEmpty.notify_one();
+    thread.detach();
+  }
+
+  virtual void push(PMessage const& m)
+  {
+    Clock::time_point const now = Clock::now();
+    State & s = *state;
+    boost::lock_guard<boost::mutex> lock(s.mutex);
+    s.stats.pushed++;
+    if (!s.stats.detached && s.options.maxLagMs && !s.buffer.empty()
+        && now - s.buffer.front().second > boost::chrono::milliseconds(s.options.maxLagMs))
+      s.detach();
+    if (!s.stats.detached && s.buffer.size() >= s.options.capacity)
+    {
+      if (s.options.detachWhenFull)
+        s.detach();
+      else
+        s.shedOldest();
+    }
+    if (s.stats.detached && !State::isStop(m))
+    {
+      s.stats.dropped++;
+      return;
+    }
+    s.buffer.push_back(std::make_pair(m, now));
+    s.notEmpty.notify_one();
+  }
+
+  // resumes delivery after the output has been detached
+  void reattach()
+  {
+    boost::lock_guard<boost::mutex> lock(state->mutex);
+    state->stats.detached = false;
+  }
+
+  bool isDetached() const
+  {
+    boost::lock_guard<boost::mutex> lock(state->mutex);
+    return state->stats.detached;
+  }
+
+  Stats getStats() const
+  {
+    Clock::time_point const now = Clock::now();
+    boost::lock_guard<boost::mutex> lock(state->mutex);
+    Stats s = state->stats;
+    s.queued = state->buffer.size();
+    if (!state->buffer.empty())
+      s.lagSeconds = boost::chrono::duration<double>(now - state->buffer.front().second).count();
+    return s;
+  }
+
+  PMessageOutput const& getOutput() const { return state->out; }
+
+private:
+  typedef std::deque<std::pair<PMessage, Clock::time_point> > buffer_t;
+
+  // shared with the thread, which may outlive the BufferedOutput
+  struct State : private boost::noncopyable
+  {
+    State(PMessageOutput const& out, Options const& options)
+    : out(out),
+      options(options),
+      stopping(false)
+    { }
+
+    static bool isStop(PMessage const& m)
+    {
+      return static_cast<bool>(msg_cast<StopMessage>(m));
+    }
+
+    // the following under the mutex
+
+    void detach()
+    {
+      stats.detached = true;
+      stats.detachments++;
+      discard();
+    }
+
+    // drops the buffered messages but StopMessages
+    void discard()
+    {
+      buffer_t kept;
+      for (buffer_t::const_iterator it = buffer.begin(); it != buffer.end(); ++it)
+        if (isStop(it->first))
+          kept.push_back(*it);
+        else
+          stats.dropped++;
+      buffer.swap(kept);
+    }
+
+    // drops the oldest message that is not a StopMessage, if any
+    void shedOldest()
+    {
+      for (buffer_t::iterator it = buffer.begin(); it != buffer.end(); ++it)
+        if (!isStop(it->first))
+        {
+          buffer.erase(it);
+          stats.dropped++;
+          return;
+        }
+    }
+
+    void deliver()
+    {
+      boost::unique_lock<boost::mutex> lock(mutex);
+      for (;;)
+      {
+        while (buffer.empty() && !stopping)
+          notEmpty.wait(lock);
+        if (buffer.empty())
+          return;   // stopping, after the StopMessages
+        PMessage const m = buffer.front().first;
+        buffer.pop_front();
+        lock.unlock();
+        out->push(m);
+        lock.lock();
+        stats.delivered++;
+      }
+    }
+
+    PMessageOutput const out;
+    Options const options;
+    mutable boost::mutex mutex;
+    boost::condition_variable notEmpty;
+    buffer_t buffer;
+    Stats stats;
+    bool stopping;
+  };
+
+  struct Deliver
+  {
+    std::tr1::shared_ptr<State> state;
+    Deliver(std::tr1::shared_ptr<State> const& state)
+    : state(state)
+    { }
+
+    void operator () ()
+    {
+      state->deliver();
+    }
+  };
+
+  std::tr1::shared_ptr<State> const state;
+  boost::thread thread;
+};
+
+typedef std::tr1::shared_ptr<BufferedOutput> PBufferedOutput;
+
+
 class MessageMulticaster : public MessageOutput
 {
 public:
@@ -156,6 +466,17 @@ public:
     return out;
   }
 
+  // Adds out behind a buffer of its own, so that a slow or blocking
+  // output does not hold up push() and the outputs after it.
+  // non-thread-safe! invoke before threads started
+  PBufferedOutput addBufferedOutput(PMessageOutput const& out,
+                                    BufferedOutput::Options const& options = BufferedOutput::Options())
+  {
+    PBufferedOutput buffered(new BufferedOutput(out, options));
+    addOutput(buffered);
+    return buffered;
+  }
+
   void clearOutputs()
   {
     outputs.clear();
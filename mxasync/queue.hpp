@@ -40,7 +40,8 @@ class Queue
 {
 public:
   Queue()
-    : _notEmptyPredicate(_queue)
+    : _dropped(0),
+      _notEmptyPredicate(_queue)
   {
   }
 
@@ -98,6 +99,64 @@ public:
     return res;
   }
 
+  // pop the oldest element for which isStale() is false;
+  // stale elements in front of it are discarded and counted in dropped_count()
+  template <class Stale>
+  T pop_fresh(Stale isStale)
+  {
+    boost::unique_lock<boost::mutex> lock(_mutex);
+    T x;
+    do
+      _notEmptyCondvar.wait(lock, _notEmptyPredicate);
+    while (!_take_front_fresh(x, isStale));
+    return x;
+  }
+
+  // discard all but the most recent element for which isStale() is false
+  template <class Stale>
+  T pop_most_recent_fresh(Stale isStale)
+  {
+    boost::unique_lock<boost::mutex> lock(_mutex);
+    T x;
+    do
+      _notEmptyCondvar.wait(lock, _notEmptyPredicate);
+    while (!_take_back_fresh(x, isStale));
+    return x;
+  }
+
+  // @return false timeout expired, t is untouched
+  // @return true everything ok, t stores the popped object
+  template <class Stale>
+  bool timed_pop_fresh(T &t, unsigned milliseconds, Stale isStale)
+  {
+    boost::system_time const until = boost::get_system_time() + boost::posix_time::millisec(milliseconds);
+    boost::unique_lock<boost::mutex> lock(_mutex);
+    while (_notEmptyCondvar.timed_wait(lock, until, _notEmptyPredicate))
+      if (_take_front_fresh(t, isStale))
+        return true;
+    return false;
+  }
+
+  // @return false timeout expired, t is untouched
+  // @return true everything ok, t stores the popped object
+  template <class Stale>
+  bool timed_pop_most_recent_fresh(T &t, unsigned milliseconds, Stale isStale)
+  {
+    boost::system_time const until = boost::get_system_time() + boost::posix_time::millisec(milliseconds);
+    boost::unique_lock<boost::mutex> lock(_mutex);
+    while (_notEmptyCondvar.timed_wait(lock, until, _notEmptyPredicate))
+      if (_take_back_fresh(t, isStale))
+        return true;
+    return false;
+  }
+
+  // number of stale elements discarded by the *_fresh pops so far
+  unsigned long dropped_count() const
+  {
+    boost::lock_guard<boost::mutex> lock(_mutex);
+    return _dropped;
+  }
+
   void clear()
   {
     boost::lock_guard<boost::mutex> lock(_mutex);
@@ -118,9 +177,45 @@ public:
 
 private:
   std::deque<T> _queue;
+  unsigned long _dropped;
   mutable boost::mutex _mutex;
   mutable boost::condition_variable _notEmptyCondvar;
 
+  template <class Stale>
+  bool _take_front_fresh(T &t, Stale &isStale)
+  {
+    while (!_queue.empty())
+    {
+      if (!isStale(_queue.front()))
+      {
+        t = _queue.front();
+        _queue.pop_front();
+        return true;
+      }
+      _queue.pop_front();
+      ++_dropped;
+    }
+    return false;
+  }
+
+  template <class Stale>
+  bool _take_back_fresh(T &t, Stale &isStale)
+  {
+    bool found = false;
+    while (!_queue.empty())
+    {
+      if (isStale(_queue.back()))
+        ++_dropped;
+      else if (!found)
+      {
+        t = _queue.back();
+        found = true;
+      }
+      _queue.pop_back();
+    }
+    return found;
+  }
+
   class _NotEmptyPredicate
   {
   public:
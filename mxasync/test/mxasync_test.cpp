@@ -0,0 +1,572 @@
+#include "gtest/gtest.h"
+#include <mxasync/batching_actor.hpp>
+#include <mxasync/buffer_pool.hpp>
+#include <mxasync/mq.hpp>
+#include <boost/lexical_cast.hpp>
+
+using namespace mxasync;
+
+namespace {
+
+typedef Message::Clock Clock;
+
+PMessage text(std::string const& s, Clock::time_point deadline = Clock::time_point())
+{
+  TextMessage *m = new TextMessage(s);
+  m->stamp();
+  m->setDeadline(deadline);
+  return PMessage(m);
+}
+
+PMessage expired(std::string const& s)
+{
+  return text(s, Clock::now() - boost::chrono::milliseconds(1));
+}
+
+PMessage fresh(std::string const& s)
+{
+  return text(s, Clock::now() + boost::chrono::hours(1));
+}
+
+double secondsSince(Clock::time_point start)
+{
+  return boost::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// implements only the plain pops, so that the *Fresh ones are the defaults
+class PlainInput : public MessageInput
+{
+public:
+  void push(PMessage const& m) { queue.push(m); }
+
+  virtual PMessage pop() { return queue.pop(); }
+  virtual PMessage popMostRecent() { return queue.pop_most_recent(); }
+  virtual bool timedPop(PMessage & m, unsigned ms) { return queue.timed_pop(m, ms); }
+  virtual bool timedPopMostRecent(PMessage & m, unsigned ms) { return queue.timed_pop_most_recent(m, ms); }
+
+private:
+  Queue<PMessage> queue;
+};
+
+// records the batches, the messages are TextMessages
+class BatchRecorder : public BatchingActor
+{
+public:
+  BatchRecorder(PMessageInput const& input, Options const& options)
+  : BatchingActor(input, options)
+  { }
+
+  std::vector<std::vector<std::string> > batches;
+  std::vector<Clock::time_point> processedAt;
+
+protected:
+  virtual void processBatch(std::vector<PMessage> const& batch)
+  {
+    processedAt.push_back(Clock::now());
+    batches.push_back(std::vector<std::string>());
+    for (size_t i = 0; i < batch.size(); ++i)
+      batches.back().push_back(batch[i]->toString());
+  }
+};
+
+// a backlog of n messages stamped gapMs apart, the last one a while ago,
+// so that the batch sizes follow from the stamps alone
+void pushStamped(MessageQueue & q, int n, int gapMs)
+{
+  Clock::time_point const first = Clock::now() - boost::chrono::milliseconds(n * gapMs + 1000);
+  for (int i = 0; i < n; ++i)
+  {
+    TextMessage *m = new TextMessage(boost::lexical_cast<std::string>(i));
+    m->stamp(first + boost::chrono::milliseconds(i * gapMs));
+    q.push(PMessage(m));
+  }
+  q.push(PMessage(new StopMessage()));
+}
+
+std::vector<size_t> batchSizes(BatchRecorder const& actor)
+{
+  std::vector<size_t> sizes;
+  for (size_t i = 0; i < actor.batches.size(); ++i)
+    sizes.push_back(actor.batches[i].size());
+  return sizes;
+}
+
+// an output that blocks in push() while the gate is closed
+class GatedOutput : public MessageOutput
+{
+public:
+  GatedOutput()
+  : open(true),
+    entered(0)
+  { }
+
+  virtual void push(PMessage const& m)
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    entered++;
+    changed.notify_all();
+    while (!open)
+      changed.wait(lock);
+    received.push_back(m->toString());
+  }
+
+  void setOpen(bool o)
+  {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    open = o;
+    changed.notify_all();
+  }
+
+  // until n pushes have begun, the last of them possibly blocked
+  void waitEntered(unsigned n)
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (entered < n)
+      changed.wait(lock);
+  }
+
+  std::vector<std::string> getReceived() const
+  {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return received;
+  }
+
+private:
+  mutable boost::mutex mutex;
+  boost::condition_variable changed;
+  bool open;
+  unsigned entered;
+  std::vector<std::string> received;
+};
+typedef std::tr1::shared_ptr<GatedOutput> PGatedOutput;
+
+void waitDelivered(BufferedOutput const& b, unsigned long n)
+{
+  for (int i = 0; i < 1000 && b.getStats().delivered < n; ++i)
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+}
+
+std::vector<std::string> strings(char const* const* s, size_t n)
+{
+  return std::vector<std::string>(s, s + n);
+}
+
+} // namespace
+
+TEST(MxAsyncTest, BufferPool)
+{
+  BufferPoolOptions options;
+  options.alignment = 256;
+  options.minCapacity = 4096;
+  options.maxCachedPerClass = 2;
+  PBufferPool pool(new BufferPool(options));
+
+  // size classes
+  EXPECT_EQ(4096u, BufferPool::capacityFor(1, 4096));
+  EXPECT_EQ(5120u, BufferPool::capacityFor(5000, 4096));
+  EXPECT_EQ(8192u, BufferPool::capacityFor(8192, 4096));
+  EXPECT_EQ(10240u, BufferPool::capacityFor(8193, 4096));
+
+  PBuffer a = pool->acquire(5000);
+  EXPECT_EQ(5000u, a->size());
+  EXPECT_EQ(5120u, a->capacity());
+  EXPECT_EQ(0u, reinterpret_cast<size_t>(a->data()) % 256);
+
+  // recycling within a size class
+  unsigned char const* const data = a->data();
+  a.reset();
+  EXPECT_EQ(1u, pool->getStats().cached);
+  PBuffer b = pool->acquire(4500);
+  EXPECT_EQ(data, b->data());
+  EXPECT_EQ(4500u, b->size());
+  EXPECT_EQ(1u, pool->getStats().hits);
+  EXPECT_EQ(1u, pool->getStats().misses);
+  EXPECT_EQ(0u, pool->getStats().cached);
+
+  PBuffer c = pool->acquire(100);
+  EXPECT_EQ(4096u, c->capacity());
+  EXPECT_NE(b->data(), c->data());
+
+  // at most maxCachedPerClass are kept
+  pool->reserve(100, 3);
+  EXPECT_EQ(2u, pool->getStats().cached);
+  EXPECT_EQ(2u * 4096, pool->getStats().cachedBytes);
+  pool->trim();
+  EXPECT_EQ(0u, pool->getStats().cached);
+
+  // buffers outlive the pool, the message keeps its buffer
+  PBufferMessage m = BufferMessage::create(b, 10, 20);
+  b.reset();
+  pool.reset();
+  std::memset(c->data(), 1, c->capacity());
+  c.reset();
+  EXPECT_EQ(20u, m->size());
+  EXPECT_EQ(data + 10, m->data());
+  m.reset();
+}
+
+TEST(MxAsyncTest, Deadlines)
+{
+  PMessage const plain = text("plain");
+  EXPECT_FALSE(plain->hasDeadline());
+  EXPECT_FALSE(plain->isExpired());
+  EXPECT_FALSE(plain->isExpired(Clock::now() + boost::chrono::hours(24 * 365)));
+  EXPECT_TRUE(expired("e")->isExpired());
+  EXPECT_FALSE(fresh("f")->isExpired());
+  EXPECT_FALSE(IsExpiredMessage()(PMessage()));
+
+  TextMessage aged("aged");
+  aged.setMaxAge(50);
+  EXPECT_NE(Clock::time_point(), aged.getTimestamp());
+  EXPECT_EQ(aged.getTimestamp() + boost::chrono::milliseconds(50), aged.getDeadline());
+
+  // expired messages are skipped and counted, the others never expire
+  MessageQueue q;
+  q.push(expired("e1"));
+  q.push(plain);
+  q.push(expired("e2"));
+  q.push(fresh("f"));
+  EXPECT_EQ("plain", q.popFresh()->toString());
+  EXPECT_EQ(1u, q.getDroppedCount());
+  EXPECT_EQ("f", q.popFresh()->toString());
+  EXPECT_EQ(2u, q.getDroppedCount());
+
+  q.push(fresh("f1"));
+  q.push(fresh("f2"));
+  q.push(expired("e3"));
+  EXPECT_EQ("f2", q.popMostRecentFresh()->toString());
+  EXPECT_EQ(3u, q.getDroppedCount());
+  EXPECT_EQ(0, q.size());
+
+  // the timed variants time out when only expired messages arrive
+  PMessage m;
+  q.push(expired("e4"));
+  Clock::time_point start = Clock::now();
+  EXPECT_FALSE(q.timedPopFresh(m, 50));
+  EXPECT_GE(secondsSince(start), 0.04);
+  EXPECT_FALSE(m);
+  EXPECT_EQ(4u, q.getDroppedCount());
+  q.push(expired("e5"));
+  start = Clock::now();
+  EXPECT_FALSE(q.timedPopMostRecentFresh(m, 50));
+  EXPECT_GE(secondsSince(start), 0.04);
+  EXPECT_EQ(5u, q.getDroppedCount());
+  q.push(expired("e6"));
+  q.push(plain);
+  EXPECT_TRUE(q.timedPopFresh(m, 50));
+  EXPECT_EQ(plain, m);
+  q.push(plain);
+  q.push(expired("e7"));
+  EXPECT_TRUE(q.timedPopMostRecentFresh(m, 50));
+  EXPECT_EQ(plain, m);
+  EXPECT_EQ(7u, q.getDroppedCount());
+
+  // the default implementations of MessageInput
+  PlainInput in;
+  in.push(expired("e"));
+  in.push(fresh("f"));
+  EXPECT_EQ("f", in.popFresh()->toString());
+  in.push(expired("e"));
+  in.push(fresh("f2"));
+  EXPECT_EQ("f2", in.popMostRecentFresh()->toString());
+  in.push(expired("e"));
+  start = Clock::now();
+  EXPECT_FALSE(in.timedPopFresh(m, 50));
+  EXPECT_GE(secondsSince(start), 0.04);
+  in.push(expired("e"));
+  in.push(plain);
+  m.reset();
+  EXPECT_TRUE(in.timedPopMostRecentFresh(m, 50));
+  EXPECT_EQ(plain, m);
+  EXPECT_EQ(0u, in.getDroppedCount());
+}
+
+TEST(MxAsyncTest, BatchingActor)
+{
+  BatchingActor::Options options;
+  options.latencyBudgetMs = 5;
+  options.maxBatch = 32;
+
+  // 20 ms between messages, far more than the budget: one at a time
+  {
+    PMessageQueue const q(new MessageQueue());
+    pushStamped(*q, 20, 20);
+    BatchRecorder actor(q, options);
+    actor.start();
+    actor.join();
+    std::vector<size_t> expected(19, 1);
+    expected[0] = 2;   // the first message gives no rate yet
+    EXPECT_EQ(expected, batchSizes(actor));
+    BatchingActor::Stats const stats = actor.getStats();
+    EXPECT_EQ(19u, stats.batches);
+    EXPECT_EQ(20u, stats.messages);
+    EXPECT_EQ(1u, stats.targetBatch);
+    EXPECT_NEAR(50, stats.arrivalRate, 1e-6);
+  }
+
+  // 1 ms between messages: as many as arrive within the budget
+  {
+    PMessageQueue const q(new MessageQueue());
+    pushStamped(*q, 21, 1);
+    BatchRecorder actor(q, options);
+    actor.start();
+    actor.join();
+    size_t const expected[] = { 5, 5, 5, 5, 1 };
+    EXPECT_EQ(std::vector<size_t>(expected, expected + 5), batchSizes(actor));
+    EXPECT_EQ(5u, actor.getStats().targetBatch);
+    EXPECT_EQ("0", actor.batches[0][0]);
+    EXPECT_EQ("20", actor.batches[4][0]);
+  }
+
+  // no gaps: batches are only bounded by maxBatch
+  {
+    PMessageQueue const q(new MessageQueue());
+    pushStamped(*q, 100, 0);
+    BatchRecorder actor(q, options);
+    actor.start();
+    actor.join();
+    size_t const expected[] = { 32, 32, 32, 4 };
+    EXPECT_EQ(std::vector<size_t>(expected, expected + 4), batchSizes(actor));
+    EXPECT_EQ(0u, actor.getStats().timedOut);
+  }
+
+  // not adaptive: always aiming at maxBatch
+  {
+    PMessageQueue const q(new MessageQueue());
+    pushStamped(*q, 40, 20);
+    BatchingActor::Options fixed = options;
+    fixed.adaptive = false;
+    BatchRecorder actor(q, fixed);
+    actor.start();
+    actor.join();
+    size_t const expected[] = { 32, 8 };
+    EXPECT_EQ(std::vector<size_t>(expected, expected + 2), batchSizes(actor));
+    EXPECT_EQ(32u, actor.getStats().targetBatch);
+  }
+
+  // a StopMessage ends run() after the messages before it
+  {
+    PMessageQueue const q(new MessageQueue());
+    q->push(text("a"));
+    q->push(text("b"));
+    q->push(PMessage(new StopMessage()));
+    q->push(text("c"));
+    BatchRecorder actor(q, options);
+    actor.start();
+    actor.join();
+    ASSERT_EQ(1u, actor.batches.size());
+    EXPECT_EQ(2u, actor.batches[0].size());
+    EXPECT_EQ(1, q->size());
+
+    BatchRecorder idle(q, options);
+    q->clear();
+    q->push(PMessage(new StopMessage()));
+    idle.start();
+    idle.join();
+    EXPECT_TRUE(idle.batches.empty());
+    EXPECT_EQ(0u, idle.getStats().batches);
+  }
+
+  // the budget closes a batch that does not fill up
+  {
+    PMessageQueue const q(new MessageQueue());
+    BatchingActor::Options slow = options;
+    slow.latencyBudgetMs = 50;
+    BatchRecorder actor(q, slow);
+    actor.start();
+    Clock::time_point const pushed = Clock::now();
+    PMessage const m(new TextMessage("late"));
+    q->push(m);
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(300));
+    q->push(PMessage(new StopMessage()));
+    actor.join();
+    ASSERT_EQ(1u, actor.batches.size());
+    double const waited = boost::chrono::duration<double>(actor.processedAt[0] - pushed).count();
+    EXPECT_GE(waited, 0.04);
+    EXPECT_LT(waited, 0.25);
+    EXPECT_EQ(1u, actor.getStats().timedOut);
+  }
+
+  BatchingActor::Options bad;
+  bad.minBatch = 4;
+  bad.maxBatch = 2;
+  EXPECT_THROW(BatchRecorder(PMessageQueue(new MessageQueue()), bad), std::invalid_argument);
+}
+
+TEST(MxAsyncTest, BufferedOutput)
+{
+  // a full buffer sheds the oldest message
+  {
+    PGatedOutput const out(new GatedOutput());
+    out->setOpen(false);
+    BufferedOutput::Options options;
+    options.capacity = 3;
+    BufferedOutput b(out, options);
+    b.push(text("0"));
+    out->waitEntered(1);
+    for (int i = 1; i < 5; ++i)
+      b.push(text(boost::lexical_cast<std::string>(i)));
+    BufferedOutput::Stats stats = b.getStats();
+    EXPECT_EQ(5u, stats.pushed);
+    EXPECT_EQ(1u, stats.dropped);
+    EXPECT_EQ(3u, stats.queued);
+    EXPECT_EQ(0u, stats.delivered);
+    EXPECT_FALSE(stats.detached);
+    EXPECT_GE(stats.lagSeconds, 0);
+    out->setOpen(true);
+    waitDelivered(b, 4);
+    char const* const expected[] = { "0", "2", "3", "4" };
+    EXPECT_EQ(strings(expected, 4), out->getReceived());
+    stats = b.getStats();
+    EXPECT_EQ(4u, stats.delivered);
+    EXPECT_EQ(0u, stats.queued);
+    EXPECT_EQ(0, stats.lagSeconds);
+  }
+
+  // or detaches the output, until reattach()
+  {
+    PGatedOutput const out(new GatedOutput());
+    out->setOpen(false);
+    BufferedOutput::Options options;
+    options.capacity = 2;
+    options.detachWhenFull = true;
+    BufferedOutput b(out, options);
+    b.push(text("0"));
+    out->waitEntered(1);
+    b.push(text("1"));
+    b.push(text("2"));
+    EXPECT_FALSE(b.isDetached());
+    b.push(text("3"));
+    EXPECT_TRUE(b.isDetached());
+    b.push(text("4"));
+    BufferedOutput::Stats const stats = b.getStats();
+    EXPECT_EQ(1u, stats.detachments);
+    EXPECT_EQ(4u, stats.dropped);
+    EXPECT_EQ(0u, stats.queued);
+    b.reattach();
+    EXPECT_FALSE(b.isDetached());
+    b.push(text("5"));
+    out->setOpen(true);
+    waitDelivered(b, 2);
+    char const* const expected[] = { "0", "5" };
+    EXPECT_EQ(strings(expected, 2), out->getReceived());
+  }
+
+  // or detaches an output lagging behind by more than maxLagMs
+  {
+    PGatedOutput const out(new GatedOutput());
+    out->setOpen(false);
+    BufferedOutput::Options options;
+    options.maxLagMs = 20;
+    BufferedOutput b(out, options);
+    b.push(text("0"));
+    out->waitEntered(1);
+    b.push(text("1"));
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(50));
+    EXPECT_GE(b.getStats().lagSeconds, 0.02);
+    EXPECT_FALSE(b.isDetached());
+    b.push(text("2"));
+    EXPECT_TRUE(b.isDetached());
+    BufferedOutput::Stats const stats = b.getStats();
+    EXPECT_EQ(1u, stats.detachments);
+    EXPECT_EQ(2u, stats.dropped);
+    b.reattach();
+    b.push(text("3"));
+    out->setOpen(true);
+    waitDelivered(b, 2);
+    char const* const expected[] = { "0", "3" };
+    EXPECT_EQ(strings(expected, 2), out->getReceived());
+  }
+
+  // the destructor neither waits for a blocked output nor delivers the rest
+  {
+    PGatedOutput out(new GatedOutput());
+    std::tr1::weak_ptr<GatedOutput> const watch(out);
+    out->setOpen(false);
+    {
+      BufferedOutput b(out);
+      b.push(text("0"));
+      out->waitEntered(1);
+      b.push(text("1"));
+    }
+    EXPECT_TRUE(out->getReceived().empty());
+    out->setOpen(true);
+    for (int i = 0; i < 1000 && out->getReceived().empty(); ++i)
+      boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+    EXPECT_EQ(std::vector<std::string>(1, "0"), out->getReceived());
+    // the thread lets go of the output once the push returns
+    out.reset();
+    for (int i = 0; i < 1000 && watch.lock(); ++i)
+      boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+    EXPECT_FALSE(watch.lock());
+  }
+
+  // StopMessages are neither shed, nor dropped while detached, nor discarded
+  {
+    PGatedOutput const out(new GatedOutput());
+    out->setOpen(false);
+    BufferedOutput::Options options;
+    options.capacity = 2;
+    BufferedOutput b(out, options);
+    b.push(text("0"));
+    out->waitEntered(1);
+    b.push(PMessage(new StopMessage()));
+    b.push(text("1"));
+    b.push(text("2"));
+    EXPECT_EQ(1u, b.getStats().dropped);
+    out->setOpen(true);
+    waitDelivered(b, 3);
+    char const* const expected[] = { "0", "stop", "2" };
+    EXPECT_EQ(strings(expected, 3), out->getReceived());
+  }
+  {
+    PGatedOutput const out(new GatedOutput());
+    out->setOpen(false);
+    BufferedOutput::Options options;
+    options.capacity = 1;
+    options.detachWhenFull = true;
+    {
+      BufferedOutput b(out, options);
+      b.push(text("0"));
+      out->waitEntered(1);
+      b.push(text("1"));
+      b.push(PMessage(new StopMessage()));
+      EXPECT_TRUE(b.isDetached());
+      b.push(text("2"));
+      b.push(PMessage(new StopMessage("stop2")));
+      BufferedOutput::Stats const stats = b.getStats();
+      EXPECT_EQ(2u, stats.dropped);
+      EXPECT_EQ(2u, stats.queued);
+    }
+    out->setOpen(true);
+    for (int i = 0; i < 1000 && out->getReceived().size() < 3; ++i)
+      boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+    char const* const expected[] = { "0", "stop", "stop2" };
+    EXPECT_EQ(strings(expected, 3), out->getReceived());
+  }
+
+  // through a multicaster, a blocked output does not hold up the others
+  {
+    PGatedOutput const slow(new GatedOutput());
+    slow->setOpen(false);
+    MessageMulticaster mc;
+    PBufferedOutput const b = mc.addBufferedOutput(slow);
+    PMessageQueue const fast = mc.createOutput();
+    for (int i = 0; i < 100; ++i)
+      mc.push(text(boost::lexical_cast<std::string>(i)));
+    EXPECT_EQ(100, fast->size());
+    EXPECT_EQ(100u, b->getStats().pushed);
+    slow->setOpen(true);
+    unsigned long const dropped = b->getStats().dropped;
+    EXPECT_GE(dropped, 100u - 64 - 1);
+    waitDelivered(*b, 100 - dropped);
+    EXPECT_EQ(100 - dropped, b->getStats().delivered);
+    EXPECT_EQ(100 - dropped, slow->getReceived().size());
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,221 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+
+#include <boost/optional.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_arithmetic.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include <mxprops/translate.h>
+
+namespace mxprops {
+
+template <typename T> class ArrayView;
+
+namespace detail {
+
+template <typename T> class TypedArrayData;
+
+// Element types of arrays: arithmetic except bool, since std::vector<bool>
+// has no contiguous storage for ArrayView to point into.
+template <typename T>
+struct IsArrayElement
+{
+  static bool const value = boost::is_arithmetic<T>::value && !boost::is_same<T, bool>::value;
+};
+
+// reads of elements as T, directly if they are stored as T
+template <typename T, bool stored = IsArrayElement<T>::value>
+struct ArrayElement
+{
+  template <typename Array>
+  static boost::optional<T> get(Array const& a, size_t i)
+  {
+    if (a.type() == typeid(T))
+      return static_cast<TypedArrayData<T> const&>(a).values()[i];
+    typedef typename Translator<T>::type Tr;
+    return Tr().get_value(a.element(i));
+  }
+};
+
+template <typename T>
+struct ArrayElement<T, false>
+{
+  template <typename Array>
+  static boost::optional<T> get(Array const& a, size_t i)
+  {
+    typedef typename Translator<T>::type Tr;
+    return Tr().get_value(a.element(i));
+  }
+};
+
+// Elements of a numeric array stored in a single record, never modified
+// once made, so that views and record copies can share them.
+class ArrayData : public boost::intrusive_ref_counter<ArrayData>
+{
+public:
+  virtual ~ArrayData() { }
+
+  virtual size_t size() const = 0;
+
+  // type of the stored elements
+  virtual std::type_info const& type() const = 0;
+
+  // appends element i as a property value to s
+  virtual void appendElement(size_t i, std::string & s) const = 0;
+
+  std::string element(size_t i) const
+  {
+    std::string s;
+    appendElement(i, s);
+    return s;
+  }
+
+  // element i converted like a property value, none if it does not convert
+  template <typename T>
+  boost::optional<T> get(size_t i) const
+  {
+    return ArrayElement<T>::get(*this, i);
+  }
+
+  // the value of the record holding the array, e.g. "[1, 2.5, 3]"
+  std::string text() const
+  {
+    std::string s = "[";
+    for (size_t i = 0; i < size(); ++i)
+    {
+      if (i)
+        s += ", ";
+      appendElement(i, s);
+    }
+    return s + "]";
+  }
+};
+
+template <typename T>
+class TypedArrayData : public ArrayData
+{
+  BOOST_STATIC_ASSERT(IsArrayElement<T>::value);
+
+public:
+  TypedArrayData(T const* first, size_t n)
+  : elements(first, first + n)
+  { }
+
+  // takes the elements of v, leaving it empty
+  explicit TypedArrayData(std::vector<T> & v)
+  {
+    elements.swap(v);
+  }
+
+  size_t size() const { return elements.size(); }
+
+  std::type_info const& type() const { return typeid(T); }
+
+  void appendElement(size_t i, std::string & s) const
+  {
+    typedef typename Translator<T>::type Tr;
+    s += Tr().put_value(elements[i]).get_value_or("<invalid>");
+  }
+
+  std::vector<T> const& values() const { return elements; }
+
+private:
+  std::vector<T> elements;
+};
+
+// the elements of a as T, shared if they are stored as T and converted
+// one by one otherwise; none if some element does not convert
+template <typename T>
+boost::optional<ArrayView<T> > viewArray(boost::intrusive_ptr<ArrayData const> const& a)
+{
+  if (a->type() == typeid(T))
+    return ArrayView<T>(boost::intrusive_ptr<TypedArrayData<T> const>(static_cast<TypedArrayData<T> const*>(a.get())));
+  std::vector<T> v;
+  v.reserve(a->size());
+  for (size_t i = 0; i < a->size(); ++i)
+  {
+    boost::optional<T> const x = a->get<T>(i);
+    if (!x)
+      return boost::optional<ArrayView<T> >();
+    v.push_back(*x);
+  }
+  return ArrayView<T>(boost::intrusive_ptr<TypedArrayData<T> const>(new TypedArrayData<T>(v)));
+}
+
+} // namespace detail
+
+// Read-only elements of an array property, see PTree::ConstRef::getArray().
+// The view keeps the elements alive, they do not change when the property
+// is written to later.
+template <typename T>
+class ArrayView
+{
+public:
+  typedef T value_type;
+  typedef T const* const_iterator;
+  typedef const_iterator iterator;
+
+  ArrayView()
+  : first(0),
+    count(0)
+  { }
+
+  explicit ArrayView(boost::intrusive_ptr<detail::TypedArrayData<T> const> const& a)
+  : owner(a),
+    first(a->values().empty() ? 0 : &a->values()[0]),
+    count(a->values().size())
+  { }
+
+  T const* data() const { return first; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  const_iterator begin() const { return first; }
+  const_iterator end() const { return first + count; }
+
+  T const& operator [] (size_t i) const { return first[i]; }
+
+  std::vector<T> toVector() const { return std::vector<T>(begin(), end()); }
+
+private:
+  boost::intrusive_ptr<detail::ArrayData const> owner;
+  T const* first;
+  size_t count;
+};
+
+} // namespace mxprops
@@ -0,0 +1,402 @@
+// Benchmarks of PTree operations. Every result is printed as one JSON
+// object per line, e.g.
+//   {"bench":"get","size":10000,"depth":4,"threads":1,"ops":200000,"ns_per_op":61.2}
+// so that runs can be collected and compared over time.
+//
+// usage: mxprops_bench [filter]
+//   only the benchmarks whose name contains filter are run
+
+#include <mxprops/mxprops.h>
+#include <mxprops/io.h>
+#include <boost/chrono.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace mxprops;
+
+namespace {
+
+typedef boost::chrono::steady_clock Clock;
+
+// keeps the results of reads from being optimized away
+volatile long sink;
+
+// from the command line, see the usage above
+std::string filter;
+
+bool selected(std::string const& bench)
+{
+  return bench.find(filter) != std::string::npos;
+}
+
+double secondsSince(Clock::time_point start)
+{
+  return boost::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Result
+{
+  Result(std::string const& bench)
+  : bench(bench)
+  , size(0)
+  , depth(0)
+  , threads(1)
+  , ops(0)
+  , seconds(0)
+  , bytes(0)
+  { }
+
+  std::string bench;
+  size_t size;
+  size_t depth;
+  size_t threads;
+  size_t ops;
+  double seconds;
+  size_t bytes;     // processed input, for throughput
+
+  void print() const
+  {
+    std::ostringstream oss;
+    oss << "{\"bench\":\"" << bench << "\",\"size\":" << size << ",\"depth\":" << depth
+        << ",\"threads\":" << threads << ",\"ops\":" << ops
+        << ",\"seconds\":" << seconds
+        << ",\"ns_per_op\":" << (ops ? seconds * 1e9 / ops : 0.0);
+    if (bytes)
+      oss << ",\"mb_per_s\":" << bytes / 1048576.0 / seconds;
+    oss << "}";
+    std::cout << oss.str() << std::endl;
+  }
+};
+
+// "p0.p1...k<i>" with depth segments in total
+std::string makePath(size_t depth, size_t i)
+{
+  std::string path;
+  for (size_t d = 1; d < depth; ++d)
+    path += "p" + boost::lexical_cast<std::string>((i >> d) % 4) + ".";
+  return path + "k" + boost::lexical_cast<std::string>(i);
+}
+
+// a fixed pseudo random visiting order, so that lookups do not walk
+// the tree in insertion order
+std::vector<std::string> shuffledPaths(size_t size, size_t depth)
+{
+  std::vector<std::string> paths;
+  paths.reserve(size);
+  for (size_t i = 0; i < size; ++i)
+    paths.push_back(makePath(depth, i));
+  unsigned long long seed = 88172645463325252ULL;
+  for (size_t i = paths.size(); i > 1; --i)
+  {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    std::swap(paths[i - 1], paths[seed % i]);
+  }
+  return paths;
+}
+
+size_t const lookupOps = 400000;
+
+void benchLookup(size_t size, size_t depth)
+{
+  if (!selected("get") && !selected("getOptional_miss") && !selected("getOptional_hit") && !selected("set"))
+    return;
+  PTree tree;
+  PTree::Ref root = tree.root("bench");
+  std::vector<std::string> const paths = shuffledPaths(size, depth);
+  for (size_t i = 0; i < size; ++i)
+    root.set(paths[i], int(i));
+
+  long sum = 0;
+  if (selected("get"))
+  {
+    Result r("get");
+    r.size = size;
+    r.depth = depth;
+    Clock::time_point const start = Clock::now();
+    for (size_t i = 0; i < lookupOps; ++i)
+      sum += root.get<int>(paths[i % size]);
+    r.seconds = secondsSince(start);
+    r.ops = lookupOps;
+    r.print();
+  }
+  if (selected("getOptional_miss"))
+  {
+    Result r("getOptional_miss");
+    r.size = size;
+    r.depth = depth;
+    Clock::time_point const start = Clock::now();
+    for (size_t i = 0; i < lookupOps; ++i)
+      sum += root.getOptional<int>(paths[i % size] + "x").get_value_or(0);
+    r.seconds = secondsSince(start);
+    r.ops = lookupOps;
+    r.print();
+  }
+  if (selected("getOptional_hit"))
+  {
+    Result r("getOptional_hit");
+    r.size = size;
+    r.depth = depth;
+    Clock::time_point const start = Clock::now();
+    for (size_t i = 0; i < lookupOps; ++i)
+      sum += root.getOptional<int>(paths[i % size]).get_value_or(0);
+    r.seconds = secondsSince(start);
+    r.ops = lookupOps;
+    r.print();
+  }
+  if (selected("set"))
+  {
+    Result r("set");
+    r.size = size;
+    r.depth = depth;
+    Clock::time_point const start = Clock::now();
+    for (size_t i = 0; i < lookupOps; ++i)
+      root.set(paths[i % size], int(i));
+    r.seconds = secondsSince(start);
+    r.ops = lookupOps;
+    r.print();
+  }
+  sink = sum;
+}
+
+class Worker
+{
+public:
+  Worker(PTree & tree, std::vector<std::string> const& paths, size_t ops, size_t writeEvery, size_t seed)
+  : tree(tree)
+  , paths(paths)
+  , ops(ops)
+  , writeEvery(writeEvery)
+  , seed(seed)
+  { }
+
+  void operator()() const
+  {
+    PTree::Ref root = tree.root("bench");
+    long sum = 0;
+    for (size_t i = 0; i < ops; ++i)
+    {
+      std::string const& path = paths[(seed + i * 7919) % paths.size()];
+      if (writeEvery && i % writeEvery == 0)
+        root.set(path, int(i));
+      else
+        sum += root.get<int>(path, 0);
+    }
+    sink = sum;
+  }
+
+private:
+  PTree & tree;
+  std::vector<std::string> const& paths;
+  size_t const ops;
+  size_t const writeEvery;
+  size_t const seed;
+};
+
+// total throughput of threads sharing one tree
+void benchThreads(std::string const& name, size_t threads, size_t writeEvery, bool snapshots)
+{
+  if (!selected(name))
+    return;
+  size_t const size = 10000, depth = 4, opsPerThread = 200000;
+  PTree::Options options;
+  options.snapshotReads = snapshots;
+  PTree tree(options);
+  std::vector<std::string> const paths = shuffledPaths(size, depth);
+  for (size_t i = 0; i < size; ++i)
+    tree.root("bench").set(paths[i], int(i));
+
+  Result r(name);
+  r.size = size;
+  r.depth = depth;
+  r.threads = threads;
+  Clock::time_point const start = Clock::now();
+  boost::thread_group group;
+  for (size_t t = 0; t < threads; ++t)
+    group.create_thread(Worker(tree, paths, opsPerThread, writeEvery, t * 104729));
+  group.join_all();
+  r.seconds = secondsSince(start);
+  r.ops = threads * opsPerThread;
+  r.print();
+}
+
+class SubtreeWriter
+{
+public:
+  SubtreeWriter(PTree::Ref const& subtree, std::vector<std::string> const& keys, size_t ops)
+  : subtree(subtree)
+  , keys(keys)
+  , ops(ops)
+  { }
+
+  void operator()() const
+  {
+    for (size_t i = 0; i < ops; ++i)
+      subtree.set(keys[i % keys.size()], int(i));
+  }
+
+private:
+  PTree::Ref subtree;
+  std::vector<std::string> const& keys;
+  size_t const ops;
+};
+
+// writers of their own subtrees "stats.t<i>", optionally with lock striping
+void benchSubtreeWriters(std::string const& name, size_t threads, size_t stripeDepth)
+{
+  if (!selected(name))
+    return;
+  size_t const opsPerThread = 200000;
+  PTree::Options options;
+  options.stripeDepth = stripeDepth;
+  PTree tree(options);
+  std::vector<std::string> keys;
+  for (size_t k = 0; k < 64; ++k)
+    keys.push_back("k" + boost::lexical_cast<std::string>(k));
+  std::vector<PTree::Ref> subtrees;
+  for (size_t t = 0; t < threads; ++t)
+  {
+    subtrees.push_back(tree.root("bench").getSubtree("stats.t" + boost::lexical_cast<std::string>(t)));
+    for (size_t k = 0; k < keys.size(); ++k)
+      subtrees.back().set(keys[k], 0);
+  }
+
+  Result r(name);
+  r.size = threads * keys.size();
+  r.depth = 3;
+  r.threads = threads;
+  Clock::time_point const start = Clock::now();
+  boost::thread_group group;
+  for (size_t t = 0; t < threads; ++t)
+    group.create_thread(SubtreeWriter(subtrees[t], keys, opsPerThread));
+  group.join_all();
+  r.seconds = secondsSince(start);
+  r.ops = threads * opsPerThread;
+  r.print();
+}
+
+void benchListKeys(size_t width)
+{
+  if (!selected("listKeys"))
+    return;
+  PTree tree;
+  PTree::Ref root = tree.root("bench");
+  for (size_t i = 0; i < width; ++i)
+    root.set("wide.k" + boost::lexical_cast<std::string>(i), int(i));
+
+  size_t const reps = std::max<size_t>(1, 2000000 / width);
+  Result r("listKeys");
+  r.size = width;
+  r.depth = 2;
+  size_t total = 0;
+  Clock::time_point const start = Clock::now();
+  for (size_t i = 0; i < reps; ++i)
+  {
+    std::vector<std::string> keys;
+    root.getSubtree("wide").listKeys(keys);
+    total += keys.size();
+  }
+  r.seconds = secondsSince(start);
+  r.ops = reps;
+  r.print();
+  if (total != reps * width)
+    std::cerr << "listKeys: unexpected key count" << std::endl;
+}
+
+// writes a document of nested objects with about targetBytes of text
+size_t writeJson(std::string const& filename, size_t targetBytes)
+{
+  std::ofstream f(filename.c_str());
+  f << "{\n";
+  size_t bytes = 2;
+  for (size_t group = 0; bytes < targetBytes; ++group)
+  {
+    std::ostringstream oss;
+    oss << (group ? ",\n" : "") << "\"group" << group << "\": {";
+    for (size_t i = 0; i < 64; ++i)
+      oss << (i ? ", " : "") << "\"item" << i << "\": {\"id\": " << group * 64 + i
+          << ", \"scale\": " << (group + i) * 0.25
+          << ", \"name\": \"item " << i << " of group " << group << "\""
+          << ", \"on\": " << (i % 2 ? "true" : "false")
+          << ", \"v\": [1, 2, 3]}";
+    oss << "}";
+    f << oss.str();
+    bytes += oss.str().size();
+  }
+  f << "\n}\n";
+  return bytes + 3;
+}
+
+void benchLoadJson(size_t megabytes)
+{
+  if (!selected("load_from_json_file"))
+    return;
+  std::string const filename = "mxprops_bench_" + boost::lexical_cast<std::string>(megabytes) + "mb.json";
+  size_t const bytes = writeJson(filename, megabytes << 20);
+
+  size_t const reps = 3;
+  Result r("load_from_json_file");
+  r.size = bytes;
+  Clock::time_point const start = Clock::now();
+  for (size_t i = 0; i < reps; ++i)
+  {
+    PTree tree;
+    std::vector<std::string> messages;
+    if (!load_from_json_file(tree.root("bench"), messages, filename))
+      std::cerr << "load_from_json_file: " << (messages.empty() ? "failed" : messages[0]) << std::endl;
+  }
+  r.seconds = secondsSince(start);
+  r.ops = reps;
+  r.bytes = reps * bytes;
+  r.print();
+  std::remove(filename.c_str());
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  if (argc > 1)
+    filter = argv[1];
+
+  {
+    size_t const sizes[] = { 1000, 10000, 100000 };
+    size_t const depths[] = { 1, 4, 8 };
+    for (size_t s = 0; s < 3; ++s)
+      for (size_t d = 0; d < 3; ++d)
+        benchLookup(sizes[s], depths[d]);
+  }
+
+  {
+    size_t const maxThreads = std::max(4u, boost::thread::hardware_concurrency());
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2)
+    {
+      benchThreads("threads_read", threads, 0, false);
+      benchThreads("threads_read_snapshots", threads, 0, true);
+      benchThreads("threads_mixed", threads, 10, false);
+      benchThreads("threads_mixed_snapshots", threads, 10, true);
+      benchSubtreeWriters("threads_subtree_writes", threads, 0);
+      benchSubtreeWriters("threads_subtree_writes_striped", threads, 2);
+    }
+  }
+
+  {
+    size_t const widths[] = { 100, 10000, 100000 };
+    for (size_t w = 0; w < 3; ++w)
+      benchListKeys(widths[w]);
+  }
+
+  {
+    size_t const megabytes[] = { 1, 8, 32 };
+    for (size_t m = 0; m < 3; ++m)
+      benchLoadJson(megabytes[m]);
+  }
+  return 0;
+}
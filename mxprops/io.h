@@ -40,13 +40,41 @@ bool load_from_command_line(mxprops::PTree::Ref const& dst,
                             int argc,
                             char const* argv[]);
 
+// Arrays are stored as keys named by the element index, so "a.3" is
+// element 3 of array "a". With numericArrays, arrays of numbers become a
+// single record instead (see PTree::Record::setArray()): "a.3" still reads
+// the element, but listings and iterators show only "a", which reads as
+// the whole array in text.
 bool load_from_json(mxprops::PTree::Ref const& dst,
                     std::vector<std::string> & messages,
-                    Json::Value const& doc);
+                    Json::Value const& doc,
+                    bool numericArrays = false);
+
+// The text loaders parse in a single pass without building a document
+// and write nothing unless the whole text is valid. Values are applied as
+// one batch, so readers see either the previous or the loaded values.
+bool load_from_json_text(mxprops::PTree::Ref const& dst,
+                         std::vector<std::string> & messages,
+                         std::string const& text,
+                         bool numericArrays = false);
 
 bool load_from_json_file(mxprops::PTree::Ref const& dst,
                          std::vector<std::string> & messages,
-                         std::string const& filename);
+                         std::string const& filename,
+                         bool numericArrays = false);
+
+// Binary snapshot of a subtree: strings are stored once, nodes in a table,
+// numbers parsed in advance. Loading needs no parsing, and the file can be
+// used in place through SnapshotView (see snapshot.h).
+// The file is replaced atomically, so it can be saved while others read it.
+bool save_snapshot(mxprops::PTree::ConstRef const& src,
+                   std::vector<std::string> & messages,
+                   std::string const& filename);
+
+// copies a snapshot into dst as a single write
+bool load_snapshot(mxprops::PTree::Ref const& dst,
+                   std::vector<std::string> & messages,
+                   std::string const& filename);
 
 void init_settings_from_command_line(mxprops::PTree::Ref const& dst,
                                      int argc,
@@ -0,0 +1,349 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+#include "mxprops.h"
+#include <boost/unordered_map.hpp>
+
+
+namespace mxprops {
+
+// A read-only view that resolves keys through an ordered chain of
+// subtrees, e.g. per-instance overrides, then group settings, then global
+// defaults, each possibly in its own PTree. The first layer that defines a
+// key wins. Nothing is copied, so instances share the layers below their
+// own overrides.
+//
+// Which layer defines a key is remembered together with the versions of
+// the trees of that layer and the ones above it (see PTree::getVersion()),
+// and reused while they stay the same, so a lookup usually costs a single
+// read of that layer. Writes to the layers below do not matter. Views made
+// by getSubtree() share these plans with the view they were made from.
+// Plans are spread over shards with locks of their own, and a shard that
+// has grown to maxPlansPerShard is emptied rather than pruned.
+//
+//   LayeredRef defaults(globalTree.root("cam"));
+//   LayeredRef cam0 = defaults.overlay(groupRef).overlay(overrides.root("cam0"));
+//   double const fx = cam0.get<double>("calib.fx");
+class LayeredRef
+{
+public:
+  static size_t const npos = size_t(-1);
+
+  LayeredRef()
+  { }
+
+  explicit LayeredRef(PTree::ConstRef const& layer)
+  : chain(new Chain(std::vector<PTree::ConstRef>(1, layer)))
+  { }
+
+  // the first layer takes precedence
+  explicit LayeredRef(std::vector<PTree::ConstRef> const& layers)
+  : chain(new Chain(layers))
+  { }
+
+  // a view of top over the layers of this one, at the same path
+  LayeredRef overlay(PTree::ConstRef const& top) const
+  {
+    std::vector<PTree::ConstRef> layers(1, top.getSubtree(prefix));
+    if (chain)
+      for (size_t i = 0; i < chain->layers.size(); ++i)
+        layers.push_back(chain->layers[i].getSubtree(prefix));
+    return LayeredRef(layers);
+  }
+
+  size_t layerCount() const { return chain ? chain->layers.size() : 0; }
+
+  // path of the view below its layers
+  std::string const& getPath() const { return prefix; }
+
+  // of the top layer
+  std::string getId() const
+  {
+    return layerCount() ? chain->layers[0].getId() : std::string();
+  }
+
+  // @return the index of the layer that defines path, npos if none does
+  size_t findLayer(const std::string &path) const
+  {
+    PKey key;
+    return plan(path, key);
+  }
+
+  // @return an undefined record if no layer defines the property
+  PTree::Record getRecord(const std::string &path) const
+  {
+    PKey key;
+    if (plan(path, key) != npos)
+    {
+      PTree::Record const r = key->getRecord("");
+      if (r.isDefined())
+        return r;
+    }
+    return resolve(PTree::joinPaths(prefix, path)).getRecord("");
+  }
+
+  template <typename TData>
+  boost::optional<TData> getOptional(const std::string &path, bool *getDefined = 0) const
+  {
+    PKey planned;
+    PTree::ConstRef key;
+    if (plan(path, planned) != npos)
+    {
+      bool defined = false;
+      boost::optional<TData> const v = planned->getOptional<TData>("", &defined);
+      if (defined)
+      {
+        if (getDefined)
+          *getDefined = true;
+        return v;
+      }
+      // undefined by a write after the plan was checked
+      key = resolve(PTree::joinPaths(prefix, path));
+    }
+    if (!key.hasOwner())
+    {
+      if (getDefined)
+        *getDefined = false;
+      return boost::optional<TData>();
+    }
+    return key.getOptional<TData>("", getDefined);
+  }
+
+  template <typename TData>
+  TData get(const std::string &path, const TData &defaultValue) const
+  {
+    return getOptional<TData>(path).get_value_or(defaultValue);
+  }
+
+  template <typename TData>
+  TData get(const std::string &path) const
+  {
+    bool isDefined = false;
+    boost::optional<TData> const v = getOptional<TData>(path, &isDefined);
+    if (!v)
+      throw PropsError(PTree::joinPaths(prefix, path), isDefined ? "Bad format " : "Undefined property: ");
+    return *v;
+  }
+
+  LayeredRef getSubtree(const std::string &path) const
+  {
+    LayeredRef r = *this;
+    r.prefix = PTree::joinPaths(prefix, path);
+    return r;
+  }
+
+  // keys of any layer, in the order of PTree::ConstRef::listKeys()
+  void listKeys(std::vector<std::string> & result, bool withUndefined = false) const
+  {
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < layerCount(); ++i)
+      chain->layers[i].getSubtree(prefix).listKeys(keys, withUndefined);
+    unite(keys, result);
+  }
+
+  void listKeysRecursive(std::vector<std::string> & result, bool withUndefined = false) const
+  {
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < layerCount(); ++i)
+      chain->layers[i].getSubtree(prefix).listKeysRecursive(keys, withUndefined);
+    unite(keys, result);
+  }
+
+private:
+  typedef boost::shared_ptr<PTree::ConstRef const> PKey;
+
+  struct Plan
+  {
+    size_t layer;
+    PKey key;                             // in that layer, resolved
+    std::vector<unsigned long> versions;  // of the layers down to it when made
+  };
+
+  // a path below the prefix of a view, hashed and compared like the joined
+  // path, so that lookups do not have to build that
+  struct FullPath
+  {
+    FullPath(std::string const& prefix, std::string const& path)
+    : prefix(prefix),
+      path(path),
+      hash(prefix.empty() ? detail::segmentHash(path)
+           : path.empty() ? detail::segmentHash(prefix)
+           : hashMore(hashMore(detail::segmentHash(prefix), "."), path))
+    { }
+
+    static boost::uint64_t hashMore(boost::uint64_t h, boost::string_ref s)
+    {
+      for (size_t i = 0; i < s.size(); ++i)
+        h = (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ULL;
+      return h;
+    }
+
+    bool operator == (std::string const& s) const
+    {
+      if (prefix.empty() || path.empty())
+        return s == (prefix.empty() ? path : prefix);
+      return s.size() == prefix.size() + 1 + path.size()
+          && s.compare(0, prefix.size(), prefix) == 0
+          && s[prefix.size()] == '.'
+          && s.compare(prefix.size() + 1, path.size(), path) == 0;
+    }
+
+    std::string const& prefix;
+    std::string const& path;
+    boost::uint64_t const hash;
+  };
+
+  struct PathHash
+  {
+    size_t operator () (std::string const& s) const { return size_t(detail::segmentHash(s)); }
+    size_t operator () (FullPath const& p) const { return size_t(p.hash); }
+  };
+
+  struct PathEqual
+  {
+    bool operator () (FullPath const& p, std::string const& s) const { return p == s; }
+    bool operator () (std::string const& s, FullPath const& p) const { return p == s; }
+  };
+
+  typedef boost::unordered_map<std::string, Plan, PathHash> plans_t;
+
+  static unsigned const shardCount = 16;
+  static size_t const maxPlansPerShard = 4096;
+
+  struct Shard
+  {
+    boost::mutex mutex;          // guards plans
+    plans_t plans;               // by full path
+  };
+
+  struct Chain : private boost::noncopyable
+  {
+    explicit Chain(std::vector<PTree::ConstRef> const& layers)
+    : layers(layers)
+    { }
+
+    // none of the layers the plan depends on has been written to since
+    bool isCurrent(Plan const& p) const
+    {
+      for (size_t i = 0; i < p.versions.size(); ++i)
+        if (layers[i].getVersion() != p.versions[i])
+          return false;
+      return true;
+    }
+
+    std::vector<PTree::ConstRef> const layers;
+    Shard shards[shardCount];
+  };
+
+  // the key in the first layer that defines full, without an owner if none does
+  PTree::ConstRef resolve(std::string const& full) const
+  {
+    for (size_t i = 0; i < layerCount(); ++i)
+      if (chain->layers[i].getRecord(full).isDefined())
+        return chain->layers[i].getSubtree(full);
+    return PTree::ConstRef();
+  }
+
+  // @return the layer planned for path below the prefix, and its key
+  size_t plan(std::string const& path, PKey & key) const
+  {
+    if (!chain)
+      return npos;
+    FullPath const full(prefix, path);
+    Shard & shard = chain->shards[(full.hash >> 32) % shardCount];
+    {
+      boost::lock_guard<boost::mutex> g(shard.mutex);
+      plans_t::const_iterator const it = shard.plans.find(full, PathHash(), PathEqual());
+      if (it != shard.plans.end() && chain->isCurrent(it->second))
+      {
+        key = it->second.key;
+        return it->second.layer;
+      }
+    }
+    // each version is read before its layer, so that a write in between
+    // fails the next check
+    std::string const joined = PTree::joinPaths(prefix, path);
+    Plan p;
+    p.layer = npos;
+    for (size_t i = 0; i < layerCount() && p.layer == npos; ++i)
+    {
+      p.versions.push_back(chain->layers[i].getVersion());
+      if (chain->layers[i].getRecord(joined).isDefined())
+      {
+        p.layer = i;
+        p.key.reset(new PTree::ConstRef(chain->layers[i].getSubtree(joined)));
+      }
+    }
+    boost::lock_guard<boost::mutex> g(shard.mutex);
+    if (shard.plans.size() >= maxPlansPerShard && !shard.plans.count(joined))
+      shard.plans.clear();
+    shard.plans[joined] = p;
+    key = p.key;
+    return p.layer;
+  }
+
+  // orders paths like the depth-first listing of a tree
+  struct PathLess
+  {
+    bool operator () (std::string const& a, std::string const& b) const
+    {
+      boost::string_ref x(a), y(b);
+      for (;;)
+      {
+        size_t const dx = x.find('.');
+        size_t const dy = y.find('.');
+        boost::string_ref const sx = x.substr(0, dx);
+        boost::string_ref const sy = y.substr(0, dy);
+        if (sx != sy)
+          return sx < sy;
+        if (dy == boost::string_ref::npos)
+          return false;          // a is b or below it
+        if (dx == boost::string_ref::npos)
+          return true;           // a is above b
+        x.remove_prefix(dx + 1);
+        y.remove_prefix(dy + 1);
+      }
+    }
+  };
+
+  static void unite(std::vector<std::string> & keys, std::vector<std::string> & result)
+  {
+    std::sort(keys.begin(), keys.end(), PathLess());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    result.insert(result.end(), keys.begin(), keys.end());
+  }
+
+  boost::shared_ptr<Chain> chain;
+  std::string prefix;
+};
+
+}
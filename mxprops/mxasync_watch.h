@@ -0,0 +1,90 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+
+#include <mxprops/mxprops.h>
+#include <mxasync/mq.hpp>
+#include <sstream>
+
+
+namespace mxprops {
+
+// Published to an mxasync output when watched properties change
+class PropsChangedMessage : public mxasync::Message
+{
+public:
+  PropsChangedMessage(PTree::Changes const& changes)
+  : changes(changes)
+  { }
+
+  PTree::Changes const& getChanges() const { return changes; }
+
+  virtual std::string toString() const
+  {
+    std::ostringstream oss;
+    oss << "PropsChangedMessage: version " << changes.version << ",";
+    for (size_t i = 0; i < changes.paths.size(); ++i)
+      oss << " " << changes.paths[i];
+    return oss.str();
+  }
+
+private:
+  PTree::Changes const changes;
+};
+DECLARE_PMESSAGE_TYPE(PropsChangedMessage);
+
+
+// WatchCallback pushing PropsChangedMessage-s to an output
+struct WatchToOutput
+{
+  mxasync::PMessageOutput out;
+
+  WatchToOutput(mxasync::PMessageOutput const& out)
+  : out(out)
+  { }
+
+  void operator () (PTree::Changes const& changes) const
+  {
+    out->push(mxasync::PMessage(new PropsChangedMessage(changes)));
+  }
+};
+
+inline PTree::WatchId watch_to_output(PTree::ConstRef const& ref,
+                                      std::string const& path,
+                                      mxasync::PMessageOutput const& out,
+                                      bool recursive = true)
+{
+  if (!out)
+    throw std::invalid_argument("null output");
+  return ref.watch(path, WatchToOutput(out), recursive);
+}
+
+} // namespace mxprops
@@ -34,14 +34,32 @@ either expressed or implied, of copyright holders.
 #include <boost/noncopyable.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/optional.hpp>
 #include <boost/property_tree/ptree.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/function.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
 #include <cstdio>
+#include <cstring>
+#include <new>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <utility>
+#include <mxprops/array.h>
 #include <mxprops/pathprop.h>
+#include <mxprops/profile.h>
+#include <mxprops/propkey.h>
+#include <mxprops/translate.h>
 
 namespace mxprops {
 
@@ -61,6 +79,274 @@ private:
   std::string propertyName;
 };
 
+namespace detail {
+
+// the typed value most recently parsed from a record
+struct TypedCache
+{
+  enum Type { Empty, Int, UInt, Double, Bool };
+
+  union
+  {
+    int i;
+    unsigned u;
+    double d;
+    bool b;
+  } v;
+  unsigned char type;   // Type, packed for the sake of Record size
+
+  TypedCache()
+  : type(Empty)
+  { }
+};
+
+// which types are cached and where they go
+template <typename T>
+struct TypedCacheSlot
+{
+  static boost::optional<T> load(TypedCache const&) { return boost::optional<T>(); }
+  static void store(TypedCache &, T const&) { }
+};
+
+#define MXPROPS_TYPED_CACHE_SLOT(T, tag, field)                   \
+template <>                                                       \
+struct TypedCacheSlot<T>                                          \
+{                                                                 \
+  static boost::optional<T> load(TypedCache const& c)             \
+  {                                                               \
+    if (c.type != TypedCache::tag)                                \
+      return boost::optional<T>();                                \
+    return c.v.field;                                             \
+  }                                                               \
+  static void store(TypedCache & c, T const& x)                   \
+  {                                                               \
+    c.v.field = x;                                                \
+    c.type = TypedCache::tag;                                     \
+  }                                                               \
+}
+
+MXPROPS_TYPED_CACHE_SLOT(int, Int, i);
+MXPROPS_TYPED_CACHE_SLOT(unsigned, UInt, u);
+MXPROPS_TYPED_CACHE_SLOT(double, Double, d);
+MXPROPS_TYPED_CACHE_SLOT(bool, Bool, b);
+
+#undef MXPROPS_TYPED_CACHE_SLOT
+
+// what few records have besides a value, shared by their copies
+struct RecordExtra : boost::intrusive_ref_counter<RecordExtra>
+{
+  RecordExtra(boost::optional<PathPropData> const& pathData,
+              boost::intrusive_ptr<ArrayData const> const& array)
+  : pathData(pathData),
+    array(array)
+  { }
+
+  boost::optional<PathPropData> const pathData;
+  boost::intrusive_ptr<ArrayData const> const array;
+};
+
+// A vector that grows by fixed-size chunks: no reallocation, no copying
+// and at most one partly used chunk, while indexing stays cheap.
+// Copies share the chunks. Writing to a shared element copies only its
+// chunk and the page (table of chunks) that holds it, so a copy costs a
+// pointer per page and a write after it a chunk and a page at most.
+// Elements do not move until the vector is copied, so references taken
+// since then stay valid.
+template <typename T>
+class ChunkedVector
+{
+public:
+  ChunkedVector()
+  : count(0)
+  { }
+
+  ChunkedVector(size_t n, T const& x)
+  : count(0)
+  {
+    for (size_t i = 0; i < n; ++i)
+      push_back(x);
+  }
+
+  size_t size() const { return count; }
+
+  T & operator [] (size_t i)
+  {
+    return own(own(pages[i >> pageShift])->chunks[(i >> chunkBits) & pageMask])->items()[i & chunkMask];
+  }
+
+  T const& operator [] (size_t i) const
+  {
+    Chunk const& c = *pages[i >> pageShift]->chunks[(i >> chunkBits) & pageMask];
+    return c.items()[i & chunkMask];
+  }
+
+  T & back() { return (*this)[count - 1]; }
+
+  // moves the n elements from i on one place up, over element i + n
+  void shiftUp(size_t i, size_t n)
+  {
+    for (size_t k = i + n; k > i; )
+    {
+      // k is the last destination left, this chunk is copied within
+      size_t const base = k & ~size_t(chunkMask);
+      T * const c = &(*this)[k] - (k - base);
+      size_t const lo = std::max(i, base);
+      std::copy_backward(c + (lo - base), c + (k - base), c + (k - base) + 1);
+      if (lo == i)
+        break;
+      c[0] = static_cast<ChunkedVector const&>(*this)[base - 1];
+      k = base - 1;
+    }
+  }
+
+  void push_back(T const& x)
+  {
+    if ((count & ((size_t(1) << pageShift) - 1)) == 0)
+      pages.push_back(boost::intrusive_ptr<Page>(new Page()));
+    boost::intrusive_ptr<Chunk> & c = own(pages.back())->chunks[(count >> chunkBits) & pageMask];
+    if (!c)
+      c.reset(new Chunk());
+    own(c)->push_back(x);
+    count++;
+  }
+
+private:
+  enum
+  {
+    chunkBits = 6, chunkMask = (1 << chunkBits) - 1,
+    pageBits = 6, pageMask = (1 << pageBits) - 1,
+    pageShift = chunkBits + pageBits
+  };
+
+  // the elements are stored in place, one indirection less to reach them
+  struct Chunk : boost::intrusive_ref_counter<Chunk>
+  {
+    Chunk()
+    : size(0)
+    { }
+
+    Chunk(Chunk const& other)
+    : boost::intrusive_ref_counter<Chunk>(),
+      size(0)
+    {
+      try
+      {
+        for (size_t i = 0; i < other.size; ++i)
+          push_back(other.items()[i]);
+      }
+      catch (...)
+      {
+        destroy();
+        throw;
+      }
+    }
+
+    ~Chunk() { destroy(); }
+
+    T * items() { return static_cast<T *>(storage.address()); }
+    T const* items() const { return static_cast<T const*>(storage.address()); }
+
+    void push_back(T const& x)
+    {
+      new (items() + size) T(x);
+      size++;
+    }
+
+    void destroy()
+    {
+      while (size != 0)
+        items()[--size].~T();
+    }
+
+    boost::aligned_storage<sizeof(T) * (chunkMask + 1), boost::alignment_of<T>::value> storage;
+    size_t size;
+  };
+
+  struct Page : boost::intrusive_ref_counter<Page>
+  {
+    boost::intrusive_ptr<Chunk> chunks[pageMask + 1];
+  };
+
+  // copies p if a copy of the vector shares it
+  template <typename P>
+  static P * own(boost::intrusive_ptr<P> & p)
+  {
+    if (p->use_count() > 1)
+      p.reset(new P(*p));
+    return p.get();
+  }
+
+  std::vector<boost::intrusive_ptr<Page> > pages;
+  size_t count;
+};
+
+// Path segments of a tree, each stored once in blocks that are only
+// released all together. Names never move, so nodes refer to them
+// directly, and snapshots keep the blocks alive by sharing the object.
+// Only names live here; values stay in the records (see Record::value).
+class SegmentArena : private boost::noncopyable
+{
+public:
+  SegmentArena()
+  : used(blockSize)
+  { }
+
+  ~SegmentArena()
+  {
+    for (size_t i = 0; i < blocks.size(); ++i)
+      delete [] blocks[i];
+  }
+
+  boost::string_ref intern(boost::string_ref s)
+  {
+    index_t::const_iterator const it = index.find(s);
+    if (it != index.end())
+      return *it;
+    boost::string_ref const r(allocate(s), s.size());
+    index.insert(r);
+    return r;
+  }
+
+private:
+  enum { blockSize = 64 * 1024 };
+
+  struct Hash
+  {
+    size_t operator () (boost::string_ref s) const { return size_t(segmentHash(s)); }
+  };
+
+  typedef boost::unordered_set<boost::string_ref, Hash> index_t;
+
+  char const* allocate(boost::string_ref s)
+  {
+    char *p;
+    if (s.size() > blockSize / 4)
+    {
+      // long names get a block of their own, inserted before the current one
+      p = new char[s.size()];
+      blocks.insert(blocks.end() - (blocks.empty() ? 0 : 1), p);
+    }
+    else
+    {
+      if (used + s.size() > blockSize)
+      {
+        blocks.push_back(new char[blockSize]);
+        used = 0;
+      }
+      p = blocks.back() + used;
+      used += s.size();
+    }
+    std::memcpy(p, s.data(), s.size());
+    return p;
+  }
+
+  std::vector<char *> blocks;
+  size_t used;            // of the last block
+  index_t index;
+};
+
+} // namespace detail
+
 class PTree : private boost::noncopyable
 {
 public:
@@ -77,59 +363,231 @@ public:
     {
       value = v;
       defined = true;
+      cache = detail::TypedCache();
+      dropArray();
     }
 
     void setValue(std::string const& v, PathPropData const& pd)
     {
       setValue(v);
-      pathData = pd;
+      extra.reset(new detail::RecordExtra(pd, 0));
     }
 
     bool isDefined() const { return defined; }
 
+    // Repeated reads of int, unsigned, double or bool are served from
+    // a cache instead of parsing the value again. Updates the cache,
+    // so the caller must have exclusive access to the record.
     template <typename TData>
     boost::optional<TData> get_as(bool *getDefined = 0) const
+    {
+      boost::optional<TData> const r = peek_as<TData>(getDefined);
+      if (r)
+        detail::TypedCacheSlot<TData>::store(cache, *r);
+      return r;
+    }
+
+    // same as get_as() but leaves the cache alone, safe for shared records
+    template <typename TData>
+    boost::optional<TData> peek_as(bool *getDefined = 0) const
     {
       if (getDefined)
         *getDefined = defined;
 
       if (!defined)
         return boost::optional<TData>();
-      typedef typename boost::property_tree::translator_between<std::string, TData>::type Tr;
+      boost::optional<TData> const cached = detail::TypedCacheSlot<TData>::load(cache);
+      if (cached)
+        return cached;
+      typedef typename detail::Translator<TData>::type Tr;
       return Tr().get_value(value);
     }
 
     template <typename TData>
     void set_as(TData const& d)
     {
-      typedef typename boost::property_tree::translator_between<std::string, TData>::type Tr;
+      typedef typename detail::Translator<TData>::type Tr;
       boost::optional<std::string> strTranslated = Tr().put_value(d);
-      defined = strTranslated;
+      defined = static_cast<bool>(strTranslated);
       value = strTranslated.get_value_or("<invalid>");
+      cache = detail::TypedCache();
+      dropArray();
     }
 
     void undefine()
     {
       defined = false;
+      cache = detail::TypedCache();
+      dropArray();
     }
 
     PathPropData const& getPathData() const
     {
-      return pathData;
+      static PathPropData const none;
+      return extra && extra->pathData ? *extra->pathData : none;
+    }
+
+    // Stores a numeric array as a contiguous vector instead of a key per
+    // element. The value becomes the text of the array, e.g. "[1, 2, 3]",
+    // and paths like "a.3" read element 3 of an array stored at "a".
+    template <typename TData>
+    void setArray(TData const* first, size_t n)
+    {
+      setArray(new detail::TypedArrayData<TData>(first, n));
+    }
+
+    // not for bool, see detail::IsArrayElement
+    template <typename TData>
+    void setArray(std::vector<TData> const& v)
+    {
+      BOOST_STATIC_ASSERT(detail::IsArrayElement<TData>::value);
+      setArray(v.empty() ? 0 : &v[0], v.size());
+    }
+
+    void setArray(boost::intrusive_ptr<detail::ArrayData const> const& a)
+    {
+      boost::optional<PathPropData> const pd = extra ? extra->pathData : boost::none;
+      value = a->text();
+      defined = true;
+      cache = detail::TypedCache();
+      extra.reset(new detail::RecordExtra(pd, a));
+    }
+
+    // @return 0 unless the record holds an array
+    detail::ArrayData const* getArrayData() const
+    {
+      return extra ? extra->array.get() : 0;
+    }
+
+    // the elements as TData, none unless the record holds an array
+    // whose elements all convert to TData
+    template <typename TData>
+    boost::optional<ArrayView<TData> > getArray() const
+    {
+      if (!getArrayData())
+        return boost::optional<ArrayView<TData> >();
+      return detail::viewArray<TData>(extra->array);
     }
 
   private:
+    void dropArray()
+    {
+      if (extra && extra->array)
+        extra.reset(extra->pathData ? new detail::RecordExtra(extra->pathData, 0) : 0);
+    }
+
+    // 64 bytes with the usual std::string, path data and arrays are rare.
+    // Values are not taken from the segment arena, as they are replaced in
+    // place: a value longer than the small string buffer is a heap
+    // allocation of its own. Snapshots share records with the tree until
+    // a write copies their chunk (see detail::ChunkedVector).
     std::string value;
+    boost::intrusive_ptr<detail::RecordExtra const> extra;
+    mutable detail::TypedCache cache;
     bool defined;
-    PathPropData pathData;
   };
 
 public:
+  struct Options
+  {
+    // read-mostly mode: readers access an immutable snapshot without
+    // locking, every write publishes a new snapshot and, once the tree is
+    // unlocked, waits until readers of the previous one are gone.
+    // Snapshots share the chunks of nodes and records (see
+    // detail::ChunkedVector), a write copies the few chunks it changes.
+    bool snapshotReads;
+
+    // start with access profiling enabled, see setProfiling()
+    bool profiling;
+
+    // Lock striping for writers to disjoint subtrees. Point reads and
+    // writes of existing keys at least stripeDepth segments deep lock
+    // only the stripe chosen by the first stripeDepth segments of their
+    // path, e.g. "stats.cam0" and "stats.cam1" with a depth of 2. Creating keys, listing,
+    // iteration, batches and writes while watchers are registered lock
+    // the whole tree, i.e. every stripe, and so see a consistent state.
+    // 0 disables striping, which is ignored with snapshotReads.
+    size_t stripeDepth;
+
+    Options()
+    : snapshotReads(false),
+      profiling(false),
+      stripeDepth(0)
+    { }
+  };
+
+  // what a watcher gets told about a write, see ConstRef::watch
+  struct Changes
+  {
+    unsigned long version;           // of the tree after the write
+    std::vector<std::string> paths;  // full paths of the changed keys
+  };
+
+  typedef boost::function<void (Changes const&)> WatchCallback;
+  typedef unsigned long WatchId;
+
+  // what getProfile() reports
+  struct Profile
+  {
+    struct Key
+    {
+      std::string path;
+      unsigned long reads;
+      unsigned long writes;
+      unsigned long misses;   // reads while undefined
+      bool defined;           // now
+    };
+
+    std::vector<Key> keys;             // accessed keys, most accessed first
+    std::vector<std::string> missing;  // read, but undefined now
+    std::vector<std::string> unused;   // defined, but never read
+
+    unsigned long lockWaits;           // contended acquisitions of the tree lock
+    double lockWaitSeconds;            // total time spent waiting for it
+    double maxLockWaitSeconds;
+  };
+
   PTree()
+  : segments(new detail::SegmentArena()),
+    cleared(false),
+    snapshot(0),
+    version(0),
+    generation(0),
+    watcherCount(0),
+    lastWatchId(0)
   { }
 
+  explicit PTree(Options const& options)
+  : segments(new detail::SegmentArena()),
+    options(options),
+    cleared(false),
+    snapshot(0),
+    version(0),
+    generation(0),
+    watcherCount(0),
+    lastWatchId(0)
+  {
+    if (options.snapshotReads)
+      snapshot = new Snapshot(storage, segments, 0, 0);
+    else if (options.stripeDepth)
+      stripes.reset(new Stripe[stripeCount]);
+    if (options.profiling)
+      profile.enable(true);
+  }
+
+  ~PTree()
+  {
+    delete snapshot.load();
+  }
+
   class Ref;
   class ConstRef;
+  template <typename TData> class ConstPropHandle;
+  template <typename TData> class PropHandle;
+  class NodeIterator;
+  class ChildIterator;
+  class SubtreeIterator;
+  class Batch;
 
   ConstRef root(const std::string &id) const;
   Ref      root(const std::string &id);
@@ -157,167 +615,1261 @@ public:
       return p.substr(0, pos);
   }
 
+  // invalidates all property handles, every watcher is notified
   void clear()
   {
-    propMap.clear();
+    WriteGuard g(*this);
+    retireProfile();
+    storage = Storage();
+    segments.reset(new detail::SegmentArena());
+    generation++;
+    cleared = true;
+
+    boost::lock_guard<boost::mutex> wg(watchMutex);
+    watchedNodes.clear();
+    for (watchers_t::iterator it = watchers.begin(); it != watchers.end(); ++it)
+    {
+      it->second->node = makeNode(0, it->second->path);
+      watchedNodes.insert(std::make_pair(it->second->node, it->first));
+    }
+    g.commit();
   }
 
-private:
-
-  typedef std::map<std::string, Record> propmap_t;
-  propmap_t propMap;
-
-  Record & getRecord(std::string const& path)
+  void unwatch(WatchId id)
   {
-    return propMap[path];
+    boost::lock_guard<boost::mutex> wg(watchMutex);
+    watchers_t::iterator const it = watchers.find(id);
+    if (it == watchers.end())
+      return;
+    std::pair<watched_t::iterator, watched_t::iterator> const r = watchedNodes.equal_range(it->second->node);
+    for (watched_t::iterator w = r.first; w != r.second; ++w)
+      if (w->second == id)
+      {
+        watchedNodes.erase(w);
+        break;
+      }
+    watchers.erase(it);
+    watcherCount--;
   }
 
-  friend class Ref;
-  friend class ConstRef;
+  Options const& getOptions() const { return options; }
 
-  boost::mutex mutex;
-};
+  // incremented by every write
+  unsigned long getVersion() const { return version.load(); }
 
-class PTree::ConstRef
-{
-public:
-  ConstRef()
-  : owner(0)
-  { }
+  // Access profiling counts reads through get()/getOptional() and property
+  // handles, every write, and the time spent waiting for the tree lock.
+  // Counting is cheap but not free; when disabled it costs a flag check.
+  void setProfiling(bool enabled) { profile.enable(enabled); }
+  bool isProfiling() const { return profile.enabled(); }
 
-  bool hasOwner() const { return owner != 0; }
+  Profile getProfile() const;
 
-  std::string getSelfPath() const { return selfPath; }
+  // forgets the counts collected so far
+  void resetProfile() { profile.reset(); }
 
-  PTree::Record getRecord(const std::string &path) const
-  {
-    assert(owner);
-    return owner->getRecord(PTree::joinPaths(selfPath, path));
-  }
+private:
 
-  template <typename TData>
-  TData get(const std::string &path, const TData &defaultValue) const
-  {
-    using boost::lexical_cast;
-    assert(owner);
-    boost::unique_lock<boost::mutex> g(owner->mutex);
-    return getRecord(path).get_as<TData>().get_value_or(defaultValue);
-  }
+  static size_t const npos = size_t(-1);
 
-  template <typename TData>
-  boost::optional<TData> getOptional(const std::string &path, bool *getDefined = 0) const
-  {
-    assert(owner);
-    boost::unique_lock<boost::mutex> g(owner->mutex);
-    return getRecord(path).get_as<TData>(getDefined);
-  }
+  // (relative path, new record) in the order of writing
+  typedef std::vector<std::pair<std::string, Record> > updates_t;
 
-  template <typename TData>
-  TData get(const std::string &path) const
-  {
-    bool isDefined = false;
-    boost::optional<TData> const v = getOptional<TData>(path, &isDefined);
-    if (!v)
-      throw PropsError(getSelfPath() + "." + path, isDefined ? "Bad format " : "Undefined property: ");
-    return *v;
-  }
+  // path segments are stored once per tree
+  typedef detail::SegmentArena segments_t;
 
-  template <typename TData>
-  TData getValue(const TData &defaultValue) const
+  // A path segment. Each node has a record, which is a property (a key)
+  // once it has been written; other nodes only lead to deeper ones.
+  struct Node
   {
-    return get<TData>("", defaultValue);
-  }
+    boost::string_ref name;      // interned, empty for the root
+    boost::uint64_t hash;        // detail::segmentHash() of the name
+    size_t parent;
+    size_t lists;                // position of the child lists in Storage::byName and byHash
+    boost::uint32_t childCount;
+    boost::uint32_t childCapacity; // entries reserved at lists
+    boost::uint32_t presentCount; // present nodes in the subtree, including this one
+    boost::uint32_t definedCount; // defined records in the subtree
+    bool present;                // has been written, i.e. is a key
+    bool array;                  // the record holds an array, changes under the tree lock only
+
+    Node(boost::string_ref name, size_t parent)
+    : name(name),
+      hash(detail::segmentHash(name)),
+      parent(parent),
+      lists(0),
+      childCount(0),
+      childCapacity(0),
+      presentCount(0),
+      definedCount(0),
+      present(false),
+      array(false)
+    { }
+  };
 
-  template <typename TData>
-  boost::optional<TData> getValue() const
+  typedef detail::ChunkedVector<Record> slots_t;
+
+  typedef std::pair<boost::uint64_t, size_t> hashed_t; // (hash, child)
+
+  // the children of a node by name, for reading
+  class ChildList
   {
-    return getOptional<TData>("");
-  }
+  public:
+    ChildList(detail::ChunkedVector<size_t> const& children, Node const& n)
+    : children(children),
+      first(n.lists),
+      count(n.childCount)
+    { }
 
-  void listKeysRecursive(std::vector<std::string> & result, bool withUndefined = false) const
+    size_t size() const { return count; }
+    size_t operator [] (size_t i) const { return children[first + i]; }
+
+  private:
+    detail::ChunkedVector<size_t> const& children;
+    size_t const first;
+    size_t const count;
+  };
+
+  // Nodes and their records are addressed by index, which stays the same
+  // until PTree::clear(). References and property handles keep such
+  // indices, and a copy of the storage needs no pointer fixups.
+  // The child lists of all nodes are ranges of two pools, which PTree::clear()
+  // releases at once. A list that outgrows its range moves to a larger one
+  // at the end and leaves the old range unused, so nodes own no memory.
+  struct Storage
   {
-    assert(owner);
-    boost::unique_lock<boost::mutex> g(owner->mutex);
+    detail::ChunkedVector<Node> nodes; // nodes[0] is the root
+    slots_t slots;               // record of nodes[i]
+    detail::ChunkedVector<size_t> byName;     // child lists of all nodes, see Node::lists
+    detail::ChunkedVector<hashed_t> byHash;   // the same, sorted for PropKey lookups
+
+    Storage()
+    : nodes(1, Node(boost::string_ref(), npos)),
+      slots(1, Record())
+    { }
+
+    ChildList children(size_t id) const { return ChildList(byName, nodes[id]); }
 
-    propmap_t const& pm = owner->propMap;
-    propmap_t::const_iterator it = pm.lower_bound(selfPath);
-    if (selfPath.empty())
+    // @return the position of name among the children of parent
+    size_t lowerBound(size_t parent, boost::string_ref name) const
     {
-      while (it != pm.end())
+      ChildList const c = children(parent);
+      size_t lo = 0, hi = c.size();
+      while (lo < hi)
       {
-        if (withUndefined || it->second.isDefined())
-          result.push_back(it->first);
-        ++it;
+        size_t const mid = (lo + hi) / 2;
+        if (nodes[c[mid]].name < name)
+          lo = mid + 1;
+        else
+          hi = mid;
       }
+      return lo;
     }
-    else
+
+    size_t findChild(size_t parent, boost::string_ref name) const
+    {
+      ChildList const c = children(parent);
+      size_t const pos = lowerBound(parent, name);
+      return pos < c.size() && nodes[c[pos]].name == name ? c[pos] : npos;
+    }
+
+    size_t findChild(size_t parent, boost::uint64_t hash, boost::string_ref name) const
     {
-      while (it != pm.end() && boost::starts_with(it->first, selfPath))
+      Node const& n = nodes[parent];
+      for (size_t pos = hashBound(n, hashed_t(hash, 0)); pos < n.childCount; ++pos)
       {
-        if (withUndefined || it->second.isDefined())
-        {
-          if (selfPath == it->first)
-            result.push_back("");
-          else
-            result.push_back(it->first.substr(selfPath.size() + 1)); // to remove the path separator
-        }
-        ++it;
+        hashed_t const& h = byHash[n.lists + pos];
+        if (h.first != hash)
+          break;
+        if (nodes[h.second].name == name)
+          return h.second;
       }
+      return npos;
     }
-  }
 
-  void listKeys(std::vector<std::string> & result, bool withUndefined = false) const
-  {
-    std::vector<std::string> allKeys;
-    listKeysRecursive(allKeys, withUndefined);
-    std::string prevKey;
-    for (size_t i = 0; i < allKeys.size(); ++i)
+    // @return the position of h among the children of n by hash
+    size_t hashBound(Node const& n, hashed_t const& h) const
     {
-      std::string const k = splitFirst(allKeys[i]);
-      if (k != prevKey)
+      size_t lo = 0, hi = n.childCount;
+      while (lo < hi)
       {
-        result.push_back(k);
-        prevKey = k;
+        size_t const mid = (lo + hi) / 2;
+        if (byHash[n.lists + mid] < h)
+          lo = mid + 1;
+        else
+          hi = mid;
       }
+      return lo;
     }
-  }
 
-  PTree::ConstRef getSubtreeForSubId(const std::string &path,
-                                            const std::string &subId) const
-  {
-    PTree::ConstRef r = getSubtree(path);
-    r.selfId = joinPaths(selfId, subId);
-    return r;
-  }
+    // Adds child to both lists of parent, at position pos by name.
+    // For writers, under PTree::mutex.
+    void addChild(size_t parent, size_t pos, size_t child)
+    {
+      Node const& p = nodes[parent];
+      size_t first = p.lists;
+      size_t const n = p.childCount;
+      if (n == p.childCapacity)
+      {
+        size_t const capacity = n ? 2 * n : 2;
+        // a new range, unless the list is the last one and can grow in place
+        if (first + n != byName.size() || n == 0)
+        {
+          Storage const& s = *this;
+          size_t const moved = byName.size();
+          for (size_t i = 0; i < n; ++i)
+          {
+            size_t const c = s.byName[first + i];
+            hashed_t const h = s.byHash[first + i];
+            byName.push_back(c);
+            byHash.push_back(h);
+          }
+          first = moved;
+        }
+        while (byName.size() < first + capacity)
+        {
+          byName.push_back(0);
+          byHash.push_back(hashed_t());
+        }
+        Node & w = nodes[parent];
+        w.lists = first;
+        w.childCapacity = boost::uint32_t(capacity);
+      }
 
-  ConstRef reIDfy(const std::string &subId) const
-  {
-    ConstRef r = *this;
-    r.selfId = joinPaths(selfId, subId);
-    return r;
-  }
+      hashed_t const h(nodes[child].hash, child);
+      size_t const hashPos = hashBound(nodes[parent], h);
+      byName.shiftUp(first + pos, n - pos);
+      byName[first + pos] = child;
+      byHash.shiftUp(first + hashPos, n - hashPos);
+      byHash[first + hashPos] = h;
+      nodes[parent].childCount++;
+    }
 
-  ConstRef getSubtree(const std::string &path) const
-  {
-    return getSubtreeImpl<ConstRef>(path);
-  }
+#ifdef MXPROPS_HAS_PROP_KEYS
+    size_t find(size_t from, PropKey const& key) const
+    {
+      size_t const hashed = std::min<size_t>(key.size(), PropKey::maxHashedSegments);
+      for (size_t i = 0; i < hashed && from != npos; ++i)
+        from = findChild(from, key.segment(i).hash, key.name(i));
+      return key.size() > hashed ? find(from, key.rest()) : from;
+    }
+#endif
 
-  std::string const& getPath() const { return selfPath; }
-  std::string const& getId() const { return selfId; }
+    // @return npos if there is no such node
+    size_t find(size_t from, boost::string_ref path) const
+    {
+      if (from == npos || path.empty())
+        return from;
+      for (;;)
+      {
+        size_t const dot = path.find('.');
+        from = findChild(from, path.substr(0, dot));
+        if (from == npos || dot == boost::string_ref::npos)
+          return from;
+        path.remove_prefix(dot + 1);
+      }
+    }
 
-protected:
+    // path of node id relative to its ancestor base
+    std::string pathOf(size_t id, size_t base = 0) const
+    {
+      size_t len = 0;
+      for (size_t i = id; i != base; i = nodes[i].parent)
+        len += nodes[i].name.size() + 1;
+      std::string result(len ? len - 1 : 0, '.');
+      for (size_t i = id; i != base; i = nodes[i].parent)
+      {
+        boost::string_ref const name = nodes[i].name;
+        len -= name.size() + 1;
+        result.replace(len, name.size(), name.data(), name.size());
+      }
+      return result;
+    }
+
+    bool isListed(size_t id, bool withUndefined) const
+    {
+      return nodes[id].present && (withUndefined || slots[id].isDefined());
+    }
+
+    // number of listed keys in the subtree
+    size_t listedCount(size_t id, bool withUndefined) const
+    {
+      return withUndefined ? nodes[id].presentCount : nodes[id].definedCount;
+    }
+
+    void listRecursive(size_t id, std::string & path, bool atBase, bool withUndefined,
+                       std::vector<std::string> & result) const
+    {
+      if (isListed(id, withUndefined))
+        result.push_back(path);
+      ChildList const c = children(id);
+      for (size_t i = 0; i < c.size(); ++i)
+      {
+        if (listedCount(c[i], withUndefined) == 0)
+          continue;
+        size_t const len = path.size();
+        if (!atBase)
+          path += '.';
+        path.append(nodes[c[i]].name.data(), nodes[c[i]].name.size());
+        listRecursive(c[i], path, false, withUndefined, result);
+        path.resize(len);
+      }
+    }
+  };
+
+  Storage storage;
+  boost::shared_ptr<segments_t> segments;
+
+  // the following are for writers, under PTree::mutex
+
+  boost::string_ref intern(boost::string_ref s)
+  {
+    return segments->intern(s);
+  }
+
+  // like Storage::find() but creates missing nodes
+  size_t makeNode(size_t from, boost::string_ref path)
+  {
+    if (path.empty())
+      return from;
+    for (;;)
+    {
+      size_t const dot = path.find('.');
+      boost::string_ref const name = path.substr(0, dot);
+      size_t const pos = storage.lowerBound(from, name);
+      Storage const& s = storage; // reads do not copy shared chunks
+      ChildList const c = s.children(from);
+      if (pos < c.size() && s.nodes[c[pos]].name == name)
+        from = c[pos];
+      else
+      {
+        size_t const id = storage.nodes.size();
+        storage.nodes.push_back(Node(intern(name), from));
+        storage.slots.push_back(Record());
+        storage.addChild(from, pos, id);
+        from = id;
+      }
+      if (dot == boost::string_ref::npos)
+        return from;
+      path.remove_prefix(dot + 1);
+    }
+  }
+
+#ifdef MXPROPS_HAS_PROP_KEYS
+  size_t makeNode(size_t from, PropKey const& key)
+  {
+    size_t const hashed = std::min<size_t>(key.size(), PropKey::maxHashedSegments);
+    for (size_t i = 0; i < hashed; ++i)
+    {
+      size_t const child = storage.findChild(from, key.segment(i).hash, key.name(i));
+      if (child == npos)
+        return makeNode(from, key.ref().substr(key.segment(i).offset));
+      from = child;
+    }
+    return key.size() > hashed ? makeNode(from, key.rest()) : from;
+  }
+#endif
+
+  // Access to a record for writing.
+  // Marks the node as a key and keeps the subtree counters up to date.
+  // An element of an array is written as a key of its own, so the array
+  // is turned into a key per element first (see Record::setArray()).
+  class RecordWriter : private boost::noncopyable
+  {
+  public:
+    RecordWriter(PTree & tree, size_t id)
+    : tree(tree),
+      id(id),
+      watched(tree.watcherCount.load() != 0)
+    {
+      Storage const& s = tree.storage; // reads do not copy shared chunks
+      size_t const parent = s.nodes[id].parent;
+      if (parent != npos && s.nodes[parent].array)
+        tree.expandArray(parent);
+      wasDefined = s.slots[id].isDefined();
+      if (watched)
+        oldValue = s.slots[id].getValue();
+    }
+
+    ~RecordWriter()
+    {
+      Storage const& s = tree.storage;
+      bool const newKey = !s.nodes[id].present;
+      bool const wasArray = s.nodes[id].array;
+      Record const& r = s.slots[id];
+      bool const isDefined = r.isDefined();
+      if (watched && (isDefined != wasDefined || (isDefined && r.getValue() != oldValue)))
+        tree.changed.push_back(id);
+      bool const array = r.getArrayData() != 0;
+      if (array && !wasArray)
+        tree.hideElements(id);
+      if (wasArray != array)
+        tree.storage.nodes[id].array = array;
+      if (tree.profile.enabled())
+        tree.profile.wrote(id, tree.generation.load());
+      if (newKey)
+        tree.storage.nodes[id].present = true;
+      if (!newKey && isDefined == wasDefined)
+        return;
+      // ancestors may be shared with writers of other stripes
+      boost::unique_lock<boost::mutex> counts(tree.countsMutex, boost::defer_lock);
+      if (tree.stripes)
+        counts.lock();
+      for (size_t i = id; i != npos; i = tree.storage.nodes[i].parent)
+      {
+        Node & p = tree.storage.nodes[i];
+        if (newKey)
+          p.presentCount++;
+        if (isDefined && !wasDefined)
+          p.definedCount++;
+        else if (!isDefined && wasDefined)
+          p.definedCount--;
+      }
+    }
+
+    Record & record() { return tree.storage.slots[id]; }
+
+  private:
+    PTree & tree;
+    size_t const id;
+    bool wasDefined;
+    bool const watched;
+    std::string oldValue;
+  };
+
+  // Replaces the array at node id with a key per element, the way the
+  // loaders stored arrays before. Under the tree lock.
+  void expandArray(size_t id)
+  {
+    boost::intrusive_ptr<detail::ArrayData const> const a = storage.slots[id].getArrayData();
+    {
+      RecordWriter w(*this, id);
+      w.record().undefine();
+    }
+    char buf[24];
+    for (size_t i = 0; i < a->size(); ++i)
+    {
+      RecordWriter w(*this, makeNode(id, boost::string_ref(buf, detail::formatInteger(buf, i) - buf)));
+      w.record().setValue(a->element(i));
+    }
+  }
+
+  // undefines the keys of elements left from before an array was stored
+  // at node id, so that they do not hide its elements
+  void hideElements(size_t id)
+  {
+    Storage const& s = storage;
+    ChildList const c = s.children(id);
+    size_t index;
+    for (size_t i = 0; i < c.size(); ++i)
+      if (s.slots[c[i]].isDefined() && isIndex(s.nodes[c[i]].name, index))
+      {
+        RecordWriter w(*this, c[i]);
+        w.record().undefine();
+      }
+  }
+
+  // whether name is an element index like "0" or "12"
+  static bool isIndex(boost::string_ref name, size_t & index)
+  {
+    if (name.empty() || name.size() > 9 || (name[0] == '0' && name.size() > 1))
+      return false;
+    index = 0;
+    for (size_t i = 0; i < name.size(); ++i)
+    {
+      if (name[i] < '0' || name[i] > '9')
+        return false;
+      index = index * 10 + size_t(name[i] - '0');
+    }
+    return true;
+  }
+
+  struct Watcher
+  {
+    std::string path;
+    size_t node;
+    bool recursive;
+    WatchCallback callback;
+  };
+
+  typedef std::map<WatchId, boost::shared_ptr<Watcher> > watchers_t;
+  typedef std::multimap<size_t, WatchId> watched_t;
+
+  typedef std::vector<std::pair<boost::shared_ptr<Watcher>, Changes> > notifications_t;
+
+  // under PTree::mutex, after a write
+  void collectNotifications(notifications_t & result, unsigned long v)
+  {
+    std::map<WatchId, size_t> pos; // of the watcher in result
+    boost::lock_guard<boost::mutex> wg(watchMutex);
+
+    if (cleared)
+    {
+      for (watchers_t::iterator it = watchers.begin(); it != watchers.end(); ++it)
+      {
+        result.push_back(std::make_pair(it->second, Changes()));
+        result.back().second.version = v;
+        result.back().second.paths.push_back(it->second->path);
+      }
+      return;
+    }
+
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    for (size_t c = 0; c < changed.size(); ++c)
+    {
+      for (size_t i = changed[c]; i != npos; i = storage.nodes[i].parent)
+      {
+        std::pair<watched_t::iterator, watched_t::iterator> const r = watchedNodes.equal_range(i);
+        for (watched_t::iterator w = r.first; w != r.second; ++w)
+        {
+          boost::shared_ptr<Watcher> const& watcher = watchers[w->second];
+          if (i != changed[c] && !watcher->recursive)
+            continue;
+          std::pair<std::map<WatchId, size_t>::iterator, bool> const p =
+              pos.insert(std::make_pair(w->second, result.size()));
+          if (p.second)
+          {
+            result.push_back(std::make_pair(watcher, Changes()));
+            result.back().second.version = v;
+          }
+          result[p.first->second].second.paths.push_back(storage.pathOf(changed[c]));
+        }
+      }
+    }
+  }
+
+  WatchId addWatcher(std::string const& path, bool recursive, WatchCallback const& callback)
+  {
+    boost::shared_ptr<Watcher> w(new Watcher());
+    w->path = path;
+    w->recursive = recursive;
+    w->callback = callback;
+
+    TreeLock g(*this);
+    w->node = makeNode(0, path);
+    boost::lock_guard<boost::mutex> wg(watchMutex);
+    WatchId const id = ++lastWatchId;
+    watchers[id] = w;
+    watchedNodes.insert(std::make_pair(w->node, id));
+    watcherCount++;
+    return id;
+  }
+
+  // immutable copy of the properties for the read-mostly mode
+  struct Snapshot
+  {
+    Storage const storage;
+    boost::shared_ptr<segments_t const> const segments; // referenced by storage
+    unsigned long const version;
+    unsigned long const generation;
+
+    Snapshot(Storage const& storage, boost::shared_ptr<segments_t const> const& segments,
+             unsigned long version, unsigned long generation)
+    : storage(storage),
+      segments(segments),
+      version(version),
+      generation(generation)
+    { }
+  };
+
+  // Grace period tracking for snapshot readers, in the spirit of RCU.
+  // Readers announce themselves in one of two sets of counters selected
+  // by the epoch parity, and never wait. A writer flips the epoch twice and
+  // waits for each set to drain, after which no reader may still hold a
+  // snapshot retired before the flips.
+  class ReaderEpochs : private boost::noncopyable
+  {
+  public:
+    ReaderEpochs()
+    : epoch(0)
+    {
+      for (unsigned i = 0; i < 2 * stripes; ++i)
+        counters[i].n = 0;
+    }
+
+    unsigned enter()
+    {
+      static boost::hash<boost::thread::id> const hasher;
+      unsigned const slot = (epoch.load() & 1) * stripes
+                          + hasher(boost::this_thread::get_id()) % stripes;
+      counters[slot].n.fetch_add(1);
+      return slot;
+    }
+
+    void leave(unsigned slot)
+    {
+      counters[slot].n.fetch_sub(1);
+    }
+
+    // writers, after replacing the snapshot; needs no lock, as each set
+    // holds its readers until they leave, whoever flips the epoch
+    void synchronize()
+    {
+      unsigned const first = epoch.fetch_add(1) & 1;
+      drain(first);
+      epoch.fetch_add(1);
+      drain(first ^ 1);
+    }
+
+  private:
+    void drain(unsigned set)
+    {
+      for (unsigned i = set * stripes; i < (set + 1) * stripes; ++i)
+        while (counters[i].n.load() != 0)
+          boost::this_thread::yield();
+    }
+
+    static unsigned const stripes = 16;
+
+    struct Counter
+    {
+      boost::atomic<long> n;
+      char padding[64 - sizeof(boost::atomic<long>)]; // one cache line each
+    };
+
+    Counter counters[2 * stripes];
+    boost::atomic<unsigned> epoch;
+  };
+
+  // One lock per stripe, see Options::stripeDepth
+  struct Stripe
+  {
+    boost::mutex mutex;
+    char padding[sizeof(boost::mutex) < 64 ? 64 - sizeof(boost::mutex) : 1];
+  };
+
+  static size_t const stripeCount = 32;
+
+  // stripe of the key at base.path, npos unless striping applies to it
+  template <typename Path>
+  size_t stripeOf(std::string const& base, Path const& path) const
+  {
+    if (!stripes)
+      return npos;
+    size_t depth = options.stripeDepth;
+    std::size_t seed = 0;
+    boost::string_ref parts[2] = { base, pathText(path) };
+    for (int p = 0; p < 2 && depth != 0; ++p)
+    {
+      boost::string_ref s = parts[p];
+      while (!s.empty() && depth != 0)
+      {
+        size_t const dot = s.find('.');
+        boost::hash_combine(seed, detail::segmentHash(s.substr(0, dot)));
+        depth--;
+        s.remove_prefix(dot == boost::string_ref::npos ? s.size() : dot + 1);
+      }
+    }
+    return depth == 0 ? seed % stripeCount : npos;
+  }
+
+  static boost::string_ref pathText(std::string const& path) { return path; }
+#ifdef MXPROPS_HAS_PROP_KEYS
+  static boost::string_ref pathText(PropKey const& key) { return key.ref(); }
+#endif
+
+  boost::mutex & lockFor(size_t stripe)
+  {
+    return stripe == npos ? mutex : stripes[stripe].mutex;
+  }
+
+  // every stripe, for access to the whole tree in striped mode
+  class AllStripes : private boost::noncopyable
+  {
+  public:
+    AllStripes()
+    : tree(0)
+    { }
+
+    ~AllStripes() { unlock(); }
+
+    void lock(PTree & t)
+    {
+      if (!t.stripes)
+        return;
+      tree = &t;
+      for (size_t i = 0; i < stripeCount; ++i)
+        tree->stripes[i].mutex.lock();
+    }
+
+    void unlock()
+    {
+      if (!tree)
+        return;
+      for (size_t i = stripeCount; i-- > 0; )
+        tree->stripes[i].mutex.unlock();
+      tree = 0;
+    }
+
+  private:
+    PTree *tree;
+  };
+
+  // locks the whole tree, for writers that need no WriteGuard
+  class TreeLock : private boost::noncopyable
+  {
+  public:
+    explicit TreeLock(PTree & tree)
+    : lock(tree.mutex)
+    {
+      all.lock(tree);
+    }
+
+  private:
+    boost::lock_guard<boost::mutex> lock;
+    AllStripes all;
+  };
+
+  // Either locks the tree or pins the current snapshot. Given a stripe
+  // (see stripeOf()), locks only that for a point read.
+  class ReadGuard : private boost::noncopyable
+  {
+  public:
+    explicit ReadGuard(PTree & tree, size_t stripe = npos)
+    : tree(tree),
+      lock(tree.lockFor(stripe), boost::defer_lock),
+      snapshot(0),
+      slot(0)
+    {
+      if (tree.options.snapshotReads)
+      {
+        slot = tree.readers.enter();
+        snapshot = tree.snapshot.load();
+        return;
+      }
+      if (tree.profile.enabled())
+        tree.profile.lock(lock);
+      else
+        lock.lock();
+      if (stripe == npos)
+        all.lock(tree);
+    }
+
+    ~ReadGuard()
+    {
+      if (snapshot)
+        tree.readers.leave(slot);
+    }
+
+    // records are shared with other readers and must not be modified
+    bool isShared() const { return snapshot != 0; }
+
+    Storage const& storage() const
+    {
+      return snapshot ? snapshot->storage : tree.storage;
+    }
+
+    unsigned long generation() const
+    {
+      return snapshot ? snapshot->generation : tree.generation.load();
+    }
+
+    // @return 0 if the node is newer than the snapshot
+    Record const* record(size_t id) const
+    {
+      slots_t const& slots = storage().slots;
+      return id < slots.size() ? &slots[id] : 0;
+    }
+
+  private:
+    PTree & tree;
+    boost::unique_lock<boost::mutex> lock;
+    AllStripes all;
+    Snapshot const* snapshot;
+    unsigned slot;
+  };
+
+  // Locks the tree for writing. A writer calls commit() when done, which
+  // copies the snapshot to publish and may throw. The destructor publishes
+  // it, so after a failed write readers keep the previous snapshot.
+  class WriteGuard : private boost::noncopyable
+  {
+  public:
+    explicit WriteGuard(PTree & tree)
+    : tree(tree),
+      lock(tree.mutex, boost::defer_lock),
+      next(0)
+    {
+      if (tree.profile.enabled())
+        tree.profile.lock(lock);
+      else
+        lock.lock();
+      all.lock(tree);
+    }
+
+    void commit()
+    {
+      if (tree.options.snapshotReads && !next)
+        next = new Snapshot(tree.storage, tree.segments, tree.version.load() + 1, tree.generation.load());
+    }
+
+    // The previous snapshot is deleted and watchers are notified once the
+    // tree is unlocked, so their callbacks may access it but must not throw
+    ~WriteGuard()
+    {
+      unsigned long const v = tree.version.fetch_add(1) + 1;
+      Snapshot const* const old = next ? tree.snapshot.exchange(next) : 0;
+      notifications_t notifications;
+      if (!tree.changed.empty() || tree.cleared)
+      {
+        tree.collectNotifications(notifications, v);
+        tree.changed.clear();
+        tree.cleared = false;
+      }
+      all.unlock();
+      lock.unlock();
+
+      if (old)
+      {
+        tree.readers.synchronize();
+        delete old;
+      }
+      for (size_t i = 0; i < notifications.size(); ++i)
+        notifications[i].first->callback(notifications[i].second);
+    }
+
+  private:
+    PTree & tree;
+    boost::unique_lock<boost::mutex> lock;
+    AllStripes all;
+    Snapshot const* next;      // to publish, see commit()
+  };
+
+  // Write access to an existing key under the lock of its stripe alone.
+  // Holds nothing if the write needs the whole tree: without a stripe,
+  // for new keys, for arrays and their elements, and while watchers are
+  // registered (they are notified under the tree lock).
+  class StripedWrite : private boost::noncopyable
+  {
+  public:
+    StripedWrite(PTree & tree, size_t stripe)
+    : tree(tree),
+      locked(0),
+      id(npos)
+    {
+      if (stripe == npos)
+        return;
+      locked = &tree.stripes[stripe].mutex;
+      if (tree.profile.enabled())
+        tree.profile.lock(*locked);
+      else
+        locked->lock();
+    }
+
+    ~StripedWrite()
+    {
+      if (!locked)
+        return;
+      tree.version.fetch_add(1);
+      locked->unlock();
+    }
+
+    bool isLocked() const { return locked != 0; }
+
+    // keeps the lock if node n can be written under it, unlocks otherwise
+    bool take(size_t n)
+    {
+      if (n != npos && tree.storage.nodes[n].present && !tree.inArray(n) && tree.watcherCount.load() == 0)
+      {
+        id = n;
+        return true;
+      }
+      locked->unlock();
+      locked = 0;
+      return false;
+    }
+
+    size_t key() const { return id; }
+
+  private:
+    PTree & tree;
+    boost::mutex *locked;
+    size_t id;
+  };
+
+  // the record of node id holds an array or is an element of one
+  bool inArray(size_t id) const
+  {
+    size_t const parent = storage.nodes[id].parent;
+    return storage.nodes[id].array || (parent != npos && storage.nodes[parent].array);
+  }
+
+  // Reads of keys that do not exist fall back to elements of arrays.
+  // Locks the whole tree, as the array may be in another stripe.
+  template <typename TData>
+  boost::optional<TData> getElement(std::string const& base, std::string const& path, bool *getDefined)
+  {
+    if (getDefined)
+      *getDefined = false;
+    size_t index;
+    std::string const& last = path.empty() ? base : path;
+    if (!isIndex(boost::string_ref(last).substr(last.rfind('.') + 1), index))
+      return boost::optional<TData>();
+    ReadGuard g(*this);
+    detail::ArrayData const* a = findArray(g, joinPaths(base, path), index);
+    if (!a)
+      return boost::optional<TData>();
+    if (getDefined)
+      *getDefined = true;
+    return a->get<TData>(index);
+  }
+
+  // the array that has element index at path, 0 if there is none
+  static detail::ArrayData const* findArray(ReadGuard const& g, std::string const& path, size_t index)
+  {
+    size_t const dot = path.rfind('.');
+    boost::string_ref const parent = dot == std::string::npos ? boost::string_ref() : boost::string_ref(path).substr(0, dot);
+    Record const* r = g.record(g.storage().find(0, parent));
+    detail::ArrayData const* a = r ? r->getArrayData() : 0;
+    return a && index < a->size() ? a : 0;
+  }
+
+  // an array stored as a key per element, "0", "1", ... below path
+  template <typename TData>
+  boost::optional<ArrayView<TData> > collectArray(std::string const& path)
+  {
+    ReadGuard g(*this);
+    Storage const& s = g.storage();
+    size_t const id = s.find(0, path);
+    std::vector<TData> v;
+    char buf[24];
+    while (id != npos)
+    {
+      Record const* r = g.record(s.findChild(id, boost::string_ref(buf, detail::formatInteger(buf, v.size()) - buf)));
+      if (!r || !r->isDefined())
+        break;
+      boost::optional<TData> const x = r->peek_as<TData>();
+      if (!x)
+        return boost::optional<ArrayView<TData> >();
+      v.push_back(*x);
+    }
+    if (v.empty())
+      return boost::optional<ArrayView<TData> >();
+    return ArrayView<TData>(new detail::TypedArrayData<TData>(v));
+  }
+
+  void profileRead(ReadGuard const& g, size_t id, Record const* r,
+                   std::string const& base, std::string const& path)
+  {
+    if (r)
+      profile.read(id, g.generation(), r->isDefined());
+    else
+      profile.readMissing(joinPaths(base, path), g.generation());
+  }
+
+  // under the write lock, before clear() drops the nodes
+  void retireProfile()
+  {
+    std::vector<detail::AccessCounts> byNode;
+    std::map<std::string, unsigned long> missing;
+    profile.collect(generation.load(), byNode, missing);
+    std::map<std::string, detail::AccessCounts> byPath;
+    for (size_t i = 0; i < byNode.size() && i < storage.nodes.size(); ++i)
+      if (!byNode[i].empty())
+        byPath[storage.pathOf(i)] += byNode[i];
+    for (std::map<std::string, unsigned long>::const_iterator it = missing.begin(); it != missing.end(); ++it)
+    {
+      detail::AccessCounts & c = byPath[it->first];
+      c.reads += it->second;
+      c.misses += it->second;
+    }
+    profile.retire(byPath);
+  }
+
+  struct MoreAccessed
+  {
+    bool operator () (Profile::Key const& a, Profile::Key const& b) const
+    {
+      if (a.reads + a.writes != b.reads + b.writes)
+        return a.reads + a.writes > b.reads + b.writes;
+      return a.path < b.path;
+    }
+  };
+
+  friend class Ref;
+  friend class ConstRef;
+  template <typename TData> friend class ConstPropHandle;
+  template <typename TData> friend class PropHandle;
+  friend class NodeIterator;
+
+  Options const options;
+  boost::mutex mutex;
+  boost::scoped_array<Stripe> stripes;   // striped mode only, taken after PTree::mutex
+  boost::mutex countsMutex;      // guards subtree counters of striped writes
+
+  std::vector<size_t> changed;   // nodes changed by the current write
+  bool cleared;                  // the current write is clear()
+  boost::mutex watchMutex;       // guards the following, taken after PTree::mutex
+  watchers_t watchers;
+  watched_t watchedNodes;
+  boost::atomic<Snapshot const*> snapshot;
+  boost::atomic<unsigned long> version;
+  boost::atomic<unsigned long> generation;  // of node indices, changed by clear()
+  boost::atomic<size_t> watcherCount;
+  WatchId lastWatchId;
+  ReaderEpochs readers;
+  detail::AccessProfile profile;
+};
+
+class PTree::ConstRef
+{
+public:
+  ConstRef()
+  : owner(0),
+    node(npos),
+    generation(0)
+  { }
+
+  bool hasOwner() const { return owner != 0; }
+
+  std::string getSelfPath() const { return selfPath; }
+
+  // @return an undefined record if there is no such property
+  PTree::Record getRecord(const std::string &path) const
+  {
+    assert(owner);
+    PTree::Record result;
+    {
+      PTree::ReadGuard g(*owner, owner->stripeOf(selfPath, path));
+      PTree::Record const* r = g.record(g.storage().find(resolve(g), path));
+      if (r)
+        result = *r;
+    }
+    if (!result.isDefined())
+    {
+      boost::optional<std::string> const element = owner->getElement<std::string>(selfPath, path, 0);
+      if (element)
+        result.setValue(*element);
+    }
+    return result;
+  }
+
+  template <typename TData>
+  TData get(const std::string &path, const TData &defaultValue) const
+  {
+    return getOptional<TData>(path).get_value_or(defaultValue);
+  }
+
+  template <typename TData>
+  boost::optional<TData> getOptional(const std::string &path, bool *getDefined = 0) const
+  {
+    assert(owner);
+    {
+      PTree::ReadGuard g(*owner, owner->stripeOf(selfPath, path));
+      size_t const id = g.storage().find(resolve(g), path);
+      PTree::Record const* r = g.record(id);
+      if (owner->profile.enabled())
+        owner->profileRead(g, id, r, selfPath, path);
+      if (r && r->isDefined())
+        return g.isShared() ? r->peek_as<TData>(getDefined) : r->get_as<TData>(getDefined);
+    }
+    return owner->getElement<TData>(selfPath, path, getDefined);
+  }
+
+  template <typename TData>
+  TData get(const std::string &path) const
+  {
+    bool isDefined = false;
+    boost::optional<TData> const v = getOptional<TData>(path, &isDefined);
+    if (!v)
+      throw PropsError(getSelfPath() + "." + path, isDefined ? "Bad format " : "Undefined property: ");
+    return *v;
+  }
+
+#ifdef MXPROPS_HAS_PROP_KEYS
+  // the same with paths hashed at compile time, see PropKey
+  template <typename TData>
+  boost::optional<TData> getOptional(PropKey const& key, bool *getDefined = 0) const
+  {
+    assert(owner);
+    {
+      PTree::ReadGuard g(*owner, owner->stripeOf(selfPath, key));
+      size_t const id = g.storage().find(resolve(g), key);
+      PTree::Record const* r = g.record(id);
+      if (owner->profile.enabled())
+        owner->profileRead(g, id, r, selfPath, key.str());
+      if (r && r->isDefined())
+        return g.isShared() ? r->peek_as<TData>(getDefined) : r->get_as<TData>(getDefined);
+    }
+    return owner->getElement<TData>(selfPath, key.str(), getDefined);
+  }
+
+  template <typename TData>
+  TData get(PropKey const& key, const TData &defaultValue) const
+  {
+    return getOptional<TData>(key).get_value_or(defaultValue);
+  }
+
+  template <typename TData>
+  TData get(PropKey const& key) const
+  {
+    bool isDefined = false;
+    boost::optional<TData> const v = getOptional<TData>(key, &isDefined);
+    if (!v)
+      throw PropsError(getSelfPath() + "." + key.str(), isDefined ? "Bad format " : "Undefined property: ");
+    return *v;
+  }
+#endif
+
+  template <typename TData>
+  TData getValue(const TData &defaultValue) const
+  {
+    return get<TData>("", defaultValue);
+  }
+
+  template <typename TData>
+  boost::optional<TData> getValue() const
+  {
+    return getOptional<TData>("");
+  }
+
+  // Elements of the numeric array at path, see Record::setArray().
+  // Arrays stored as a key per element ("a.0", "a.1", ...) are collected.
+  // @return none if there is no array or some element does not convert
+  template <typename TData>
+  boost::optional<ArrayView<TData> > getArray(const std::string &path) const
+  {
+    assert(owner);
+    {
+      PTree::ReadGuard g(*owner, owner->stripeOf(selfPath, path));
+      PTree::Record const* r = g.record(g.storage().find(resolve(g), path));
+      if (r && r->getArrayData())
+        return r->getArray<TData>();
+    }
+    return owner->collectArray<TData>(joinPaths(selfPath, path));
+  }
+
+  // keys are listed depth-first, children in lexicographic order
+  void listKeysRecursive(std::vector<std::string> & result, bool withUndefined = false) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    size_t const base = resolve(g);
+    if (base == npos)
+      return;
+    std::string path;
+    g.storage().listRecursive(base, path, true, withUndefined, result);
+  }
+
+  void listKeys(std::vector<std::string> & result, bool withUndefined = false) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    size_t const base = resolve(g);
+    if (base == npos)
+      return;
+    PTree::Storage const& s = g.storage();
+    if (s.isListed(base, withUndefined))
+      result.push_back("");
+    PTree::ChildList const c = s.children(base);
+    for (size_t i = 0; i < c.size(); ++i)
+      if (s.listedCount(c[i], withUndefined) != 0)
+        result.push_back(s.nodes[c[i]].name.to_string());
+  }
+
+  PTree::ConstRef getSubtreeForSubId(const std::string &path,
+                                            const std::string &subId) const
+  {
+    PTree::ConstRef r = getSubtree(path);
+    r.selfId = joinPaths(selfId, subId);
+    return r;
+  }
+
+  ConstRef reIDfy(const std::string &subId) const
+  {
+    ConstRef r = *this;
+    r.selfId = joinPaths(selfId, subId);
+    return r;
+  }
+
+  ConstRef getSubtree(const std::string &path) const
+  {
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    return ConstRef(*owner, joinPaths(selfPath, path), selfId,
+                    g.storage().find(resolve(g), path), g.generation());
+  }
+
+  // resolves the path once if the key exists, creates nothing;
+  // a handle made before the key is looked up by path on every read
+  template <typename TData>
+  PTree::ConstPropHandle<TData> getHandle(const std::string &path) const
+  {
+    assert(owner);
+    return PTree::ConstPropHandle<TData>(*owner, joinPaths(selfPath, path));
+  }
+
+  // Invokes callback after every write that changes the property at
+  // path or, if recursive, anything below it. Changes made by a single
+  // write are reported together. The callback runs in the writing thread
+  // with the tree unlocked.
+  PTree::WatchId watch(const std::string &path,
+                       PTree::WatchCallback const& callback,
+                       bool recursive = true) const
+  {
+    assert(owner);
+    return owner->addWatcher(joinPaths(selfPath, path), recursive, callback);
+  }
+
+  void unwatch(PTree::WatchId id) const
+  {
+    assert(owner);
+    owner->unwatch(id);
+  }
+
+  std::string const& getPath() const { return selfPath; }
+  std::string const& getId() const { return selfId; }
+
+  // of the whole tree, see PTree::getVersion()
+  unsigned long getVersion() const
+  {
+    assert(owner);
+    return owner->getVersion();
+  }
+
+protected:
 
   ConstRef(PTree &owner,
            const std::string &selfPath,
-           const std::string &selfId)
+           const std::string &selfId,
+           size_t node,
+           unsigned long generation)
   : owner(&owner),
     selfPath(selfPath),
-    selfId(selfId)
+    selfId(selfId),
+    node(node),
+    generation(generation)
   {
     assert(this->owner);
   }
 
   friend class PTree;
+  friend class PTree::NodeIterator;
+
+  // node of this reference in the storage seen by g, npos if there is none
+  size_t resolve(PTree::ReadGuard const& g) const
+  {
+    if (node == npos || generation != g.generation())
+      return g.storage().find(0, selfPath);
+    return node < g.storage().nodes.size() ? node : npos;
+  }
+
+  // the same for writers holding a stripe, who cannot create it
+  size_t resolveExisting() const
+  {
+    if (node == npos || generation != owner->generation.load())
+      return owner->storage.find(0, selfPath);
+    return node;
+  }
+
+  // the same for writers, creates the node if needed
+  size_t resolveForWrite() const
+  {
+    if (node == npos || generation != owner->generation.load())
+      return owner->makeNode(0, selfPath);
+    return node;
+  }
 
   // using pointers instead of smart pointers for the time being
   // to think less about the underlying data structure
@@ -328,12 +1880,10 @@ protected:
   std::string selfPath;
   std::string selfId;
 
-  template <typename TSelf>
-  TSelf getSubtreeImpl(const std::string &path) const
-  {
-    assert(owner);
-    return TSelf(*owner, joinPaths(selfPath, path), selfId);
-  }
+  // node index resolved when the reference was made, npos if there was
+  // no such node; selfPath is used instead after PTree::clear()
+  size_t node;
+  unsigned long generation;
 };
 
 
@@ -343,42 +1893,135 @@ public:
   Ref()
   { }
 
-  void setRecord(const std::string &path, PTree::Record const& r)
+  void setRecord(const std::string &path, PTree::Record const& r) const
   {
     assert(owner);
-    boost::lock_guard<boost::mutex> g(owner->mutex);
-    owner->getRecord(PTree::joinPaths(selfPath, path)) = r;
+    PTree::StripedWrite s(*owner, owner->stripeOf(selfPath, path));
+    if (s.isLocked() && s.take(r.getArrayData() ? npos : owner->storage.find(resolveExisting(), path)))
+    {
+      PTree::RecordWriter w(*owner, s.key());
+      w.record() = r;
+      return;
+    }
+    PTree::WriteGuard g(*owner);
+    {
+      PTree::RecordWriter w(*owner, owner->makeNode(resolveForWrite(), path));
+      w.record() = r;
+    }
+    g.commit();
   }
 
   template <typename TData>
   void set(const std::string &path, const TData &value) const
   {
-    using boost::lexical_cast;
     assert(owner);
-    boost::lock_guard<boost::mutex> g(owner->mutex);
-    owner->getRecord(PTree::joinPaths(selfPath, path)).set_as<TData>(value);
+    PTree::StripedWrite s(*owner, owner->stripeOf(selfPath, path));
+    if (s.isLocked() && s.take(owner->storage.find(resolveExisting(), path)))
+    {
+      PTree::RecordWriter w(*owner, s.key());
+      w.record().set_as<TData>(value);
+      return;
+    }
+    PTree::WriteGuard g(*owner);
+    {
+      PTree::RecordWriter w(*owner, owner->makeNode(resolveForWrite(), path));
+      w.record().set_as<TData>(value);
+    }
+    g.commit();
+  }
+
+#ifdef MXPROPS_HAS_PROP_KEYS
+  template <typename TData>
+  void set(PropKey const& key, const TData &value) const
+  {
+    assert(owner);
+    PTree::StripedWrite s(*owner, owner->stripeOf(selfPath, key));
+    if (s.isLocked() && s.take(owner->storage.find(resolveExisting(), key)))
+    {
+      PTree::RecordWriter w(*owner, s.key());
+      w.record().set_as<TData>(value);
+      return;
+    }
+    PTree::WriteGuard g(*owner);
+    {
+      PTree::RecordWriter w(*owner, owner->makeNode(resolveForWrite(), key));
+      w.record().set_as<TData>(value);
+    }
+    g.commit();
+  }
+#endif
+
+  // stores the elements as a single key, see Record::setArray()
+  template <typename TData>
+  void setArray(const std::string &path, TData const* first, size_t n) const
+  {
+    PTree::Record r;
+    r.setArray(first, n);
+    setRecord(path, r);
+  }
+
+  template <typename TData>
+  void setArray(const std::string &path, std::vector<TData> const& v) const
+  {
+    PTree::Record r;
+    r.setArray(v);
+    setRecord(path, r);
   }
 
   void undefine(const std::string &path) const
   {
-    using boost::lexical_cast;
     assert(owner);
-    boost::lock_guard<boost::mutex> g(owner->mutex);
-    owner->getRecord(PTree::joinPaths(selfPath, path)).undefine();
+    PTree::StripedWrite s(*owner, owner->stripeOf(selfPath, path));
+    if (s.isLocked() && s.take(owner->storage.find(resolveExisting(), path)))
+    {
+      PTree::RecordWriter w(*owner, s.key());
+      w.record().undefine();
+      return;
+    }
+    PTree::WriteGuard g(*owner);
+    {
+      PTree::RecordWriter w(*owner, owner->makeNode(resolveForWrite(), path));
+      w.record().undefine();
+    }
+    g.commit();
   }
 
   template <typename TData>
   void setValue(const TData &value) const
   {
     assert(owner);
-    boost::lock_guard<boost::mutex> g(owner->mutex);
-    // do not record access, for it's slow
-    owner->getRecord(selfPath).set_as<TData>(value);
+    PTree::WriteGuard g(*owner);
+    {
+      // the node is resolved already, no path lookup
+      PTree::RecordWriter w(*owner, resolveForWrite());
+      w.record().set_as<TData>(value);
+    }
+    g.commit();
   }
 
+  // Copies every key of src into this subtree as a single write, so
+  // readers and watchers see either none or all of the changes.
+  // Keys undefined in src are undefined here as well.
+  void merge(PTree::ConstRef const& src) const;
+
+  // see PTree::Batch
+  PTree::Batch batch() const;
+
+  // like ConstRef::getSubtree, the nodes are only made by writes
   PTree::Ref getSubtree(const std::string &path) const
   {
-    return getSubtreeImpl<Ref>(path);
+    assert(owner);
+    PTree::ReadGuard g(*owner);
+    return Ref(*owner, joinPaths(selfPath, path), selfId,
+               g.storage().find(resolve(g), path), g.generation());
+  }
+
+  // resolves the path once, creating the node if needed
+  template <typename TData>
+  PTree::PropHandle<TData> getHandle(const std::string &path) const
+  {
+    assert(owner);
+    return PTree::PropHandle<TData>(*owner, joinPaths(selfPath, path));
   }
 
   PTree::Ref getSubtreeForSubId(const std::string &path,
@@ -399,15 +2042,472 @@ public:
 
 protected:
   friend class PTree;
+  friend class PTree::Batch;
+
+  // writes all updates under a single lock
+  void apply(PTree::updates_t const& updates) const;
 
   Ref(PTree &owner,
       const std::string &selfPath,
-      const std::string &selfId)
-  : ConstRef(owner, selfPath, selfId)
+      const std::string &selfId,
+      size_t node,
+      unsigned long generation)
+  : ConstRef(owner, selfPath, selfId, node, generation)
+  { }
+};
+
+
+// Iteration over a subtree that neither copies keys nor collects them.
+// The tree stays locked (or the snapshot pinned) while an iterator is
+// alive, so access the tree only through the iterator until it is gone.
+//
+//   for (PTree::ChildIterator it(ref); !it.atEnd(); it.next())
+//     use(it.key(), it.get<int>());
+class PTree::NodeIterator : private boost::noncopyable
+{
+public:
+  bool atEnd() const { return current == npos; }
+
+  // name of the current node, valid while the iterator is alive
+  boost::string_ref key() const
+  {
+    PTree::Node const& n = g.storage().nodes[current];
+    return n.name;
+  }
+
+  // path of the current node relative to the base
+  std::string path() const
+  {
+    return g.storage().pathOf(current, baseNode);
+  }
+
+  bool isDefined() const { return record().isDefined(); }
+
+  PTree::Record const& record() const
+  {
+    return g.storage().slots[current];
+  }
+
+  template <typename TData>
+  boost::optional<TData> get(bool *getDefined = 0) const
+  {
+    return g.isShared() ? record().peek_as<TData>(getDefined) : record().get_as<TData>(getDefined);
+  }
+
+  // a reference to the current node for use after the iteration
+  PTree::ConstRef ref() const
+  {
+    return PTree::ConstRef(*base.owner, joinPaths(base.selfPath, path()), base.selfId,
+                           current, g.generation());
+  }
+
+protected:
+  NodeIterator(PTree::ConstRef const& base, bool withUndefined)
+  : g(*base.owner),
+    base(base),
+    baseNode(base.resolve(g)),
+    current(npos),
+    withUndefined(withUndefined)
+  { }
+
+  PTree::Storage const& storage() const { return g.storage(); }
+
+  PTree::ReadGuard g;
+  PTree::ConstRef const& base;
+  size_t const baseNode;
+  size_t current;
+  bool const withUndefined;
+};
+
+
+// Children of a node that have keys in their subtrees, see ConstRef::listKeys
+class PTree::ChildIterator : public PTree::NodeIterator
+{
+public:
+  explicit ChildIterator(PTree::ConstRef const& base, bool withUndefined = false)
+  : NodeIterator(base, withUndefined),
+    pos(0)
+  {
+    seek();
+  }
+
+  void next()
+  {
+    assert(!atEnd());
+    ++pos;
+    seek();
+  }
+
+private:
+  void seek()
+  {
+    current = npos;
+    if (baseNode == npos)
+      return;
+    PTree::ChildList const c = storage().children(baseNode);
+    while (pos < c.size() && storage().listedCount(c[pos], withUndefined) == 0)
+      ++pos;
+    if (pos < c.size())
+      current = c[pos];
+  }
+
+  size_t pos;
+};
+
+
+// All keys of a subtree, including the base itself, in the order of
+// ConstRef::listKeysRecursive
+class PTree::SubtreeIterator : public PTree::NodeIterator
+{
+public:
+  explicit SubtreeIterator(PTree::ConstRef const& base, bool withUndefined = false)
+  : NodeIterator(base, withUndefined)
+  {
+    if (baseNode == npos || storage().listedCount(baseNode, withUndefined) == 0)
+      return;
+    current = baseNode;
+    if (!storage().isListed(current, withUndefined))
+      next();
+  }
+
+  void next()
+  {
+    assert(!atEnd());
+    do
+      advance();
+    while (current != npos && !storage().isListed(current, withUndefined));
+  }
+
+private:
+  // pre-order step, skipping subtrees without keys
+  void advance()
+  {
+    PTree::Storage const& s = storage();
+    size_t const child = firstListed(current, 0);
+    if (child != npos)
+    {
+      current = child;
+      return;
+    }
+    while (current != baseNode)
+    {
+      PTree::Node const& n = s.nodes[current];
+      size_t const sibling = firstListed(n.parent, s.lowerBound(n.parent, n.name) + 1);
+      if (sibling != npos)
+      {
+        current = sibling;
+        return;
+      }
+      current = n.parent;
+    }
+    current = npos;
+  }
+
+  size_t firstListed(size_t parent, size_t from) const
+  {
+    PTree::ChildList const c = storage().children(parent);
+    for (size_t i = from; i < c.size(); ++i)
+      if (storage().listedCount(c[i], withUndefined) != 0)
+        return c[i];
+    return npos;
+  }
+};
+
+
+// A property resolved once, see ConstRef::getHandle.
+// Access through a handle costs a slot lookup instead of path handling.
+// Handles stay valid when properties are added, but not across PTree::clear();
+// a stale handle reads as undefined. A ConstPropHandle made before its key
+// existed stays unbound and reads by path.
+template <typename TData>
+class PTree::ConstPropHandle
+{
+public:
+  ConstPropHandle()
+  : owner(0),
+    slot(0),
+    stripe(npos),
+    generation(0)
+  { }
+
+  bool hasOwner() const { return owner != 0; }
+
+  std::string const& getPath() const { return path; }
+
+  boost::optional<TData> getOptional(bool *getDefined = 0) const
+  {
+    assert(owner);
+    {
+      PTree::ReadGuard g(*owner, stripe);
+      size_t id = slot;
+      PTree::Record const* r = 0;
+      if (slot == npos)
+      {
+        id = g.storage().find(0, path);
+        r = id == npos ? 0 : g.record(id);
+      }
+      else if (generation == g.generation())
+        r = g.record(slot);
+      if (owner->profile.enabled())
+        owner->profileRead(g, id, r, path, "");
+      if (r && r->isDefined())
+        return g.isShared() ? r->peek_as<TData>(getDefined) : r->get_as<TData>(getDefined);
+    }
+    return owner->template getElement<TData>(path, std::string(), getDefined);
+  }
+
+  TData get(const TData &defaultValue) const
+  {
+    return getOptional().get_value_or(defaultValue);
+  }
+
+  TData get() const
+  {
+    bool isDefined = false;
+    boost::optional<TData> const v = getOptional(&isDefined);
+    if (!v)
+      throw PropsError(path, isDefined ? "Bad format " : "Undefined property: ");
+    return *v;
+  }
+
+protected:
+  friend class PTree::ConstRef;
+
+  ConstPropHandle(PTree &owner, const std::string &path)
+  : owner(&owner),
+    path(path),
+    stripe(owner.stripeOf(path, std::string()))
+  {
+    PTree::ReadGuard g(owner, stripe);
+    slot = g.storage().find(0, path);
+    generation = g.generation();
+  }
+
+  PTree *owner;
+  std::string path;
+  size_t slot;                   // npos while unbound
+  size_t stripe;                 // see PTree::stripeOf()
+  unsigned long generation;
+};
+
+
+template <typename TData>
+class PTree::PropHandle : public PTree::ConstPropHandle<TData>
+{
+public:
+  PropHandle()
+  { }
+
+  void set(const TData &value) const
+  {
+    assert(this->owner);
+    PTree::StripedWrite s(*this->owner, this->stripe);
+    if (s.isLocked() && s.take(current() ? this->slot : npos))
+    {
+      PTree::RecordWriter w(*this->owner, s.key());
+      w.record().template set_as<TData>(value);
+      return;
+    }
+    PTree::WriteGuard g(*this->owner);
+    checkCurrent();
+    {
+      PTree::RecordWriter w(*this->owner, this->slot);
+      w.record().template set_as<TData>(value);
+    }
+    g.commit();
+  }
+
+  void undefine() const
+  {
+    assert(this->owner);
+    PTree::StripedWrite s(*this->owner, this->stripe);
+    if (s.isLocked() && s.take(current() ? this->slot : npos))
+    {
+      PTree::RecordWriter w(*this->owner, s.key());
+      w.record().undefine();
+      return;
+    }
+    PTree::WriteGuard g(*this->owner);
+    checkCurrent();
+    {
+      PTree::RecordWriter w(*this->owner, this->slot);
+      w.record().undefine();
+    }
+    g.commit();
+  }
+
+protected:
+  friend class PTree::Ref;
+
+  // writers make the node, so that the handle is always bound
+  PropHandle(PTree &owner, const std::string &path)
+  : PTree::ConstPropHandle<TData>(owner, path)
+  {
+    if (this->slot != npos)
+      return;
+    PTree::TreeLock g(owner);
+    this->slot = owner.makeNode(0, path);
+    this->generation = owner.generation.load();
+  }
+
+private:
+  // under the write lock or a stripe
+  bool current() const
+  {
+    return this->generation == this->owner->generation.load();
+  }
+
+  void checkCurrent() const
+  {
+    if (!current())
+      throw PropsError(this->path, "Stale property handle: ");
+  }
+};
+
+
+// Writes staged without locking the tree and then applied as a single
+// write: commit() locks the tree once and bumps the version once, so
+// readers and watchers see either none or all of the staged changes.
+// Writes that are not committed are dropped.
+//
+//   PTree::Batch b = ref.batch();
+//   b.set("calib.fx", fx);
+//   b.set("calib.fy", fy);
+//   b.commit();
+class PTree::Batch
+{
+public:
+  explicit Batch(PTree::Ref const& dst)
+  : dst(dst)
   { }
+
+  void setRecord(const std::string &path, PTree::Record const& r)
+  {
+    stage(path) = r;
+  }
+
+  template <typename TData>
+  void set(const std::string &path, const TData &value)
+  {
+    stage(path).set_as<TData>(value);
+  }
+
+  template <typename TData>
+  void setArray(const std::string &path, TData const* first, size_t n)
+  {
+    stage(path).setArray(first, n);
+  }
+
+  template <typename TData>
+  void setArray(const std::string &path, std::vector<TData> const& v)
+  {
+    stage(path).setArray(v);
+  }
+
+  void undefine(const std::string &path)
+  {
+    stage(path).undefine();
+  }
+
+  // number of staged writes
+  size_t size() const { return updates.size(); }
+  bool empty() const { return updates.empty(); }
+
+  // drops the staged writes
+  void clear() { updates.clear(); }
+
+  void commit()
+  {
+    if (updates.empty())
+      return;
+    dst.apply(updates);
+    updates.clear();
+  }
+
+private:
+  PTree::Record & stage(const std::string &path)
+  {
+    updates.push_back(std::make_pair(path, PTree::Record()));
+    return updates.back().second;
+  }
+
+  PTree::Ref dst;
+  PTree::updates_t updates;
 };
 
 
+inline void PTree::Ref::apply(PTree::updates_t const& updates) const
+{
+  assert(owner);
+  PTree::WriteGuard g(*owner);
+  size_t const base = resolveForWrite();
+  for (size_t i = 0; i < updates.size(); ++i)
+  {
+    PTree::RecordWriter w(*owner, owner->makeNode(base, updates[i].first));
+    w.record() = updates[i].second;
+  }
+  g.commit();
+}
+
+inline void PTree::Ref::merge(PTree::ConstRef const& src) const
+{
+  PTree::updates_t updates;
+  for (PTree::SubtreeIterator it(src, true); !it.atEnd(); it.next())
+    updates.push_back(std::make_pair(it.path(), it.record()));
+  apply(updates);
+}
+
+inline PTree::Batch PTree::Ref::batch() const
+{
+  return PTree::Batch(*this);
+}
+
+inline PTree::Profile PTree::getProfile() const
+{
+  PTree & self = const_cast<PTree &>(*this);
+  TreeLock g(self);
+  std::vector<detail::AccessCounts> byNode;
+  std::map<std::string, unsigned long> missing;
+  profile.collect(generation.load(), byNode, missing);
+  std::map<std::string, detail::AccessCounts> byPath = profile.retired();
+  for (size_t i = 0; i < byNode.size() && i < storage.nodes.size(); ++i)
+    if (!byNode[i].empty())
+      byPath[storage.pathOf(i)] += byNode[i];
+  for (std::map<std::string, unsigned long>::const_iterator it = missing.begin(); it != missing.end(); ++it)
+  {
+    detail::AccessCounts & c = byPath[it->first];
+    c.reads += it->second;
+    c.misses += it->second;
+  }
+
+  Profile p;
+  for (std::map<std::string, detail::AccessCounts>::const_iterator it = byPath.begin(); it != byPath.end(); ++it)
+  {
+    size_t const id = storage.find(0, it->first);
+    Profile::Key const k = { it->first, it->second.reads, it->second.writes, it->second.misses,
+                             id != npos && storage.slots[id].isDefined() };
+    p.keys.push_back(k);
+    if (k.misses != 0 && !k.defined)
+      p.missing.push_back(k.path);
+  }
+  std::sort(p.keys.begin(), p.keys.end(), MoreAccessed());
+
+  for (size_t i = 0; i < storage.nodes.size(); ++i)
+    if (storage.slots[i].isDefined())
+    {
+      std::map<std::string, detail::AccessCounts>::const_iterator const it = byPath.find(storage.pathOf(i));
+      if (it == byPath.end() || it->second.reads == 0)
+        p.unused.push_back(storage.pathOf(i));
+    }
+  std::sort(p.unused.begin(), p.unused.end());
+
+  unsigned long long total = 0, longest = 0;
+  profile.lockStats(p.lockWaits, total, longest);
+  p.lockWaitSeconds = total * 1e-9;
+  p.maxLockWaitSeconds = longest * 1e-9;
+  return p;
+}
+
 inline PTree::ConstRef PTree::root(const std::string &id) const
 {
   return const_cast<PTree *>(this)->root(id);
@@ -415,7 +2515,7 @@ inline PTree::ConstRef PTree::root(const std::string &id) const
 
 inline PTree::Ref PTree::root(const std::string &id)
 {
-  return Ref(*this, "", id);
+  return Ref(*this, "", id, 0, generation.load());
 }
 
 
@@ -0,0 +1,327 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace mxprops {
+namespace detail {
+
+struct AccessCounts
+{
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long misses;   // reads of undefined properties
+
+  AccessCounts()
+  : reads(0),
+    writes(0),
+    misses(0)
+  { }
+
+  AccessCounts & operator += (AccessCounts const& c)
+  {
+    reads += c.reads;
+    writes += c.writes;
+    misses += c.misses;
+    return *this;
+  }
+
+  bool empty() const { return reads == 0 && writes == 0 && misses == 0; }
+};
+
+// Access counters of a PTree, kept per node index.
+//
+// Every thread counts into a shard of its own, so counting needs neither
+// locks nor atomic read-modify-write operations; a report sums the shards.
+// A shard belongs to one tree generation (see PTree::clear) and is emptied
+// when its thread first sees a newer one, after the tree has moved the
+// counts of the old generation to retired().
+class AccessProfile : private boost::noncopyable
+{
+public:
+  AccessProfile()
+  : on(false),
+    resets(0),
+    id(nextId()),
+    lockWaits(0),
+    lockWaitNs(0),
+    maxLockWaitNs(0)
+  { }
+
+  ~AccessProfile()
+  {
+    for (size_t i = 0; i < shards.size(); ++i)
+      delete shards[i];
+  }
+
+  bool enabled() const { return on.load(boost::memory_order_relaxed); }
+  void enable(bool enabled) { on.store(enabled); }
+
+  void read(size_t node, unsigned long generation, bool defined)
+  {
+    Shard *const s = shard(generation);
+    if (!s)
+      return;
+    Slot & c = s->slot(node);
+    bump(c.reads);
+    if (!defined)
+      bump(c.misses);
+  }
+
+  // a read of a path without a node
+  void readMissing(std::string const& path, unsigned long generation)
+  {
+    Shard *const s = shard(generation);
+    if (!s)
+      return;
+    boost::lock_guard<boost::mutex> g(s->mutex);
+    s->missing[path]++;
+  }
+
+  void wrote(size_t node, unsigned long generation)
+  {
+    Shard *const s = shard(generation);
+    if (s)
+      bump(s->slot(node).writes);
+  }
+
+  // only contended acquisitions are timed
+  template <typename Lockable>
+  void lock(Lockable & l)
+  {
+    if (l.try_lock())
+      return;
+    boost::chrono::steady_clock::time_point const start = boost::chrono::steady_clock::now();
+    l.lock();
+    unsigned long long const ns = boost::chrono::duration_cast<boost::chrono::nanoseconds>(
+        boost::chrono::steady_clock::now() - start).count();
+    lockWaits.fetch_add(1, boost::memory_order_relaxed);
+    lockWaitNs.fetch_add(ns, boost::memory_order_relaxed);
+    unsigned long long m = maxLockWaitNs.load(boost::memory_order_relaxed);
+    while (ns > m && !maxLockWaitNs.compare_exchange_weak(m, ns, boost::memory_order_relaxed))
+      ;
+  }
+
+  // sums the shards of a generation
+  void collect(unsigned long generation,
+               std::vector<AccessCounts> & byNode,
+               std::map<std::string, unsigned long> & missing) const
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    unsigned long const r = resets.load();
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+      Shard const& s = *shards[i];
+      boost::lock_guard<boost::mutex> sg(s.mutex);
+      if (s.generation != generation || s.resets != r)
+        continue;
+      if (byNode.size() < s.chunks.size() * chunkSize)
+        byNode.resize(s.chunks.size() * chunkSize);
+      for (size_t c = 0; c < s.chunks.size(); ++c)
+        for (size_t k = 0; k < chunkSize; ++k)
+        {
+          Slot const& slot = s.chunks[c][k];
+          AccessCounts & a = byNode[c * chunkSize + k];
+          a.reads += slot.reads.load(boost::memory_order_relaxed);
+          a.writes += slot.writes.load(boost::memory_order_relaxed);
+          a.misses += slot.misses.load(boost::memory_order_relaxed);
+        }
+      for (std::map<std::string, unsigned long>::const_iterator it = s.missing.begin(); it != s.missing.end(); ++it)
+        missing[it->first] += it->second;
+    }
+  }
+
+  // counts of earlier generations, by path
+  std::map<std::string, AccessCounts> retired() const
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    return retiredCounts;
+  }
+
+  void retire(std::map<std::string, AccessCounts> const& counts)
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    for (std::map<std::string, AccessCounts>::const_iterator it = counts.begin(); it != counts.end(); ++it)
+      retiredCounts[it->first] += it->second;
+  }
+
+  void lockStats(unsigned long & waits, unsigned long long & totalNs, unsigned long long & maxNs) const
+  {
+    waits = lockWaits.load();
+    totalNs = lockWaitNs.load();
+    maxNs = maxLockWaitNs.load();
+  }
+
+  // shards are emptied by their threads on their next access
+  void reset()
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    resets++;
+    retiredCounts.clear();
+    lockWaits = 0;
+    lockWaitNs = 0;
+    maxLockWaitNs = 0;
+  }
+
+private:
+  enum { chunkSize = 1024 };
+
+  struct Slot
+  {
+    boost::atomic<unsigned long> reads;
+    boost::atomic<unsigned long> writes;
+    boost::atomic<unsigned long> misses;
+  };
+
+  // Counters of one thread. Only the owning thread changes the shard;
+  // it takes the mutex to change anything but the counters themselves.
+  struct Shard
+  {
+    Shard(unsigned long generation, unsigned long resets)
+    : generation(generation),
+      resets(resets)
+    { }
+
+    ~Shard()
+    {
+      for (size_t i = 0; i < chunks.size(); ++i)
+        delete [] chunks[i];
+    }
+
+    Slot & slot(size_t node)
+    {
+      size_t const c = node / chunkSize;
+      if (c >= chunks.size())
+        grow(c + 1);
+      return chunks[c][node % chunkSize];
+    }
+
+    void grow(size_t count)
+    {
+      std::vector<Slot *> more;
+      for (size_t i = chunks.size(); i < count; ++i)
+      {
+        Slot *const chunk = new Slot[chunkSize];
+        for (size_t k = 0; k < chunkSize; ++k)
+        {
+          chunk[k].reads = 0;
+          chunk[k].writes = 0;
+          chunk[k].misses = 0;
+        }
+        more.push_back(chunk);
+      }
+      boost::lock_guard<boost::mutex> g(mutex);
+      chunks.insert(chunks.end(), more.begin(), more.end());
+    }
+
+    void renew(unsigned long g, unsigned long r)
+    {
+      boost::lock_guard<boost::mutex> lg(mutex);
+      for (size_t i = 0; i < chunks.size(); ++i)
+        delete [] chunks[i];
+      chunks.clear();
+      missing.clear();
+      generation = g;
+      resets = r;
+    }
+
+    mutable boost::mutex mutex;
+    unsigned long generation;
+    unsigned long resets;
+    std::vector<Slot *> chunks;
+    std::map<std::string, unsigned long> missing;
+  };
+
+  // thread_specific_ptr values outlive the profile in other threads,
+  // so they are checked to belong to this profile
+  struct Local
+  {
+    Shard *shard;
+    unsigned long profile;
+  };
+
+  static unsigned long nextId()
+  {
+    static boost::atomic<unsigned long> last(0);
+    return ++last;
+  }
+
+  static void bump(boost::atomic<unsigned long> & c)
+  {
+    c.store(c.load(boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
+  }
+
+  // @return 0 for a reader of a generation older than the shard
+  Shard * shard(unsigned long generation)
+  {
+    Local *l = local.get();
+    if (!l || l->profile != id)
+    {
+      l = new Local();
+      l->profile = id;
+      l->shard = new Shard(generation, resets.load());
+      local.reset(l);
+      boost::lock_guard<boost::mutex> g(mutex);
+      shards.push_back(l->shard);
+    }
+    Shard *const s = l->shard;
+    unsigned long const r = resets.load(boost::memory_order_relaxed);
+    if (s->generation != generation || s->resets != r)
+    {
+      if (generation < s->generation)
+        return 0;
+      s->renew(generation, r);
+    }
+    return s;
+  }
+
+  boost::atomic<bool> on;
+  boost::atomic<unsigned long> resets;
+  unsigned long const id;
+  boost::thread_specific_ptr<Local> local;
+
+  mutable boost::mutex mutex;   // guards the following
+  std::vector<Shard *> shards;
+  std::map<std::string, AccessCounts> retiredCounts;
+
+  boost::atomic<unsigned long> lockWaits;
+  boost::atomic<unsigned long long> lockWaitNs;
+  boost::atomic<unsigned long long> maxLockWaitNs;
+};
+
+} // namespace detail
+} // namespace mxprops
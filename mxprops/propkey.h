@@ -0,0 +1,177 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+#pragma once
+
+#include <boost/config.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <string>
+
+#if !defined(BOOST_NO_CXX11_CONSTEXPR) \
+ && !defined(BOOST_NO_CXX11_USER_DEFINED_LITERALS) \
+ && !defined(BOOST_NO_CXX11_DELEGATING_CONSTRUCTORS)
+# define MXPROPS_HAS_PROP_KEYS 1
+#endif
+
+namespace mxprops {
+namespace detail {
+
+// FNV-1a of a path segment, as stored in PTree nodes
+inline boost::uint64_t segmentHash(boost::string_ref s)
+{
+  boost::uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < s.size(); ++i)
+    h = (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ULL;
+  return h;
+}
+
+#ifdef MXPROPS_HAS_PROP_KEYS
+
+// the same in the form constexpr functions take in C++11
+
+constexpr boost::uint64_t segmentHash(char const* s, size_t end, size_t i, boost::uint64_t h)
+{
+  return i >= end ? h : segmentHash(s, end, i + 1, (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ULL);
+}
+
+constexpr size_t segmentEnd(char const* s, size_t n, size_t i)
+{
+  return i >= n || s[i] == '.' ? i : segmentEnd(s, n, i + 1);
+}
+
+// start of the k-th segment, past n if there are fewer
+constexpr size_t segmentStart(char const* s, size_t n, size_t k, size_t i)
+{
+  return k == 0 || i > n ? i : segmentStart(s, n, k - 1, segmentEnd(s, n, i) + 1);
+}
+
+constexpr size_t countDots(char const* s, size_t n, size_t i)
+{
+  return i >= n ? 0 : (s[i] == '.' ? 1 : 0) + countDots(s, n, i + 1);
+}
+
+#endif
+
+} // namespace detail
+
+#ifdef MXPROPS_HAS_PROP_KEYS
+
+// A property path split into segments and hashed at compile time.
+// PTree::ConstRef::get() and PTree::Ref::set() take keys in place of
+// paths, and look the nodes up by the hashes instead of comparing names.
+//
+//   using namespace mxprops::literals;
+//   static constexpr mxprops::PropKey scale = "detector.scale"_prop;
+//   double s = ref.get<double>(scale);
+//
+// A key is only guaranteed to be computed at compile time when it is
+// constexpr, as above. Paths are limited by the constexpr evaluation
+// depth of the compiler, 512 characters by default.
+class PropKey
+{
+public:
+  // deeper segments are looked up by name
+  enum { maxHashedSegments = 8 };
+
+  struct Segment
+  {
+    size_t offset;
+    size_t length;
+    boost::uint64_t hash;
+  };
+
+  template <size_t N>
+  constexpr explicit PropKey(char const (&path)[N])
+  : PropKey(path, N - 1)
+  { }
+
+  constexpr PropKey(char const* path, size_t length)
+  : path(path),
+    length(length),
+    count(length == 0 ? 0 : 1 + detail::countDots(path, length, 0)),
+    segments{ make(path, length, 0), make(path, length, 1), make(path, length, 2),
+              make(path, length, 3), make(path, length, 4), make(path, length, 5),
+              make(path, length, 6), make(path, length, 7) }
+  { }
+
+  std::string str() const { return std::string(path, length); }
+  boost::string_ref ref() const { return boost::string_ref(path, length); }
+
+  // number of segments
+  constexpr size_t size() const { return count; }
+
+  constexpr Segment const& segment(size_t i) const { return segments[i]; }
+
+  boost::string_ref name(size_t i) const
+  {
+    return boost::string_ref(path + segments[i].offset, segments[i].length);
+  }
+
+  // the path after the hashed segments
+  boost::string_ref rest() const
+  {
+    if (count <= maxHashedSegments)
+      return boost::string_ref();
+    Segment const& last = segments[maxHashedSegments - 1];
+    return ref().substr(last.offset + last.length + 1);
+  }
+
+private:
+  static constexpr Segment make(char const* s, size_t n, size_t k)
+  {
+    return makeAt(s, n, detail::segmentStart(s, n, k, 0));
+  }
+
+  static constexpr Segment makeAt(char const* s, size_t n, size_t start)
+  {
+    return start > n
+        ? Segment{ n, 0, 0 }
+        : Segment{ start, detail::segmentEnd(s, n, start) - start,
+                   detail::segmentHash(s, detail::segmentEnd(s, n, start), start, 14695981039346656037ULL) };
+  }
+
+  char const* path;
+  size_t length;
+  size_t count;
+  Segment segments[maxHashedSegments];
+};
+
+inline namespace literals {
+
+constexpr PropKey operator "" _prop(char const* path, size_t length)
+{
+  return PropKey(path, length);
+}
+
+} // namespace literals
+
+#endif
+
+} // namespace mxprops
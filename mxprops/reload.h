@@ -0,0 +1,100 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+#pragma once
+#include "mxprops.h"
+#include <boost/scoped_ptr.hpp>
+
+
+namespace mxprops {
+
+// Keeps a subtree in sync with JSON configuration files.
+//
+// A reload parses all sources in the order they were added into a private
+// tree, compares it with the live dst and applies only the difference,
+// as a single write (see PTree::Ref::merge). Values written to dst by
+// others are thus overwritten by the next reload; keys that no source
+// ever set are left alone, keys removed from the sources are undefined.
+// Readers therefore see either the old or the new configuration. A source
+// that fails to parse leaves dst untouched.
+//
+// After start() a background thread reloads whenever one of the files
+// changes: inotify on Linux, modification time polling elsewhere.
+class ConfigReloader : private boost::noncopyable
+{
+public:
+  // quietMilliseconds: how long the files must stay unchanged before
+  // a reload, so that a file is not read halfway through a save
+  explicit ConfigReloader(PTree::Ref const& dst, unsigned quietMilliseconds = 100);
+  ~ConfigReloader();
+
+  // sources, later ones take precedence
+  void addFile(std::string const& filename);
+  void addOverride(std::string const& propLine);  // "name=value"
+
+  // @return false if a source failed, see getMessages()
+  bool reload();
+
+  void start();
+  void stop();
+
+  // messages of the last failed reload
+  std::vector<std::string> getMessages() const;
+
+  // number of successful reloads
+  unsigned long getReloadCount() const;
+
+private:
+  struct Source
+  {
+    bool isFile;
+    std::string text;   // filename or property line
+  };
+
+  class FileWatch;
+
+  void run();
+  bool loadSources(PTree::Ref const& dst, std::vector<std::string> & messages) const;
+
+  PTree::Ref const dst;
+  unsigned const quietMilliseconds;
+  std::vector<Source> sources;
+
+  boost::mutex reloadMutex;       // one reload at a time
+  mutable boost::mutex mutex;     // guards the following
+  boost::scoped_ptr<PTree> current;
+  std::vector<std::string> messages;
+  unsigned long reloadCount;
+
+  boost::scoped_ptr<FileWatch> watch;
+  boost::thread thread;
+};
+
+} // namespace mxprops
@@ -0,0 +1,128 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+
+
+#pragma once
+#include "snapshot.h"
+
+
+namespace mxprops {
+
+namespace detail {
+struct SharedControl;
+}
+
+// Live configuration shared by the processes of a host through POSIX
+// shared memory. One process publishes snapshots of a subtree (in the
+// format of save_snapshot()), any number of processes read them in place.
+//
+// Every publish() creates a new shared memory object "<name>.<version>"
+// and then announces the version in a small control object "<name>".
+// Readers check the announced version on every access, without locking,
+// and map a newer snapshot when there is one. A snapshot is never
+// modified after it is announced, and a reader keeps its mapping after
+// the publisher removes the name, so reads are never torn.
+//
+// Names follow shm_open(): a leading '/' and no other slashes.
+class SharedConfigPublisher : private boost::noncopyable
+{
+public:
+  SharedConfigPublisher();
+  ~SharedConfigPublisher();
+
+  // creates the control object, or takes over an existing one
+  // @return false if shared memory is not available
+  bool open(std::string const& name, std::vector<std::string> & messages);
+  bool isOpen() const { return control != 0; }
+
+  // makes a snapshot of src the current configuration
+  bool publish(PTree::ConstRef const& src, std::vector<std::string> & messages);
+
+  // of the last published snapshot, 0 before the first one
+  unsigned long long getVersion() const { return version; }
+
+  // removes the names of the control object and the current snapshot,
+  // open views keep reading what they have mapped
+  void unlink();
+
+private:
+  void close();
+
+  std::string name;
+  detail::SharedControl *control;
+  unsigned long long version;
+};
+
+// The reading side of SharedConfigPublisher. Every access first checks
+// whether a newer snapshot has been published, which is a single atomic
+// load. A view must not be used by several threads at once; open one
+// per thread instead, they share the mapped pages.
+class SharedConfigView
+{
+public:
+  SharedConfigView();
+
+  // @return false if there is no publisher of the name
+  bool open(std::string const& name, std::vector<std::string> & messages);
+  bool isOpen() const { return control.get() != 0; }
+
+  // version of the snapshot read by this view, 0 if there is none
+  unsigned long long getVersion() const { return version; }
+
+  // the latest published snapshot; keep the returned view to read
+  // several keys from the same version
+  SnapshotView const& snapshot() const;
+
+  template <typename TData>
+  boost::optional<TData> getOptional(const std::string &path, bool *getDefined = 0) const
+  {
+    return snapshot().getOptional<TData>(path, getDefined);
+  }
+
+  template <typename TData>
+  TData get(const std::string &path, const TData &defaultValue) const
+  {
+    return snapshot().get<TData>(path, defaultValue);
+  }
+
+  template <typename TData>
+  TData get(const std::string &path) const
+  {
+    return snapshot().get<TData>(path);
+  }
+
+private:
+  std::string name;
+  boost::shared_ptr<detail::SharedControl const> control;
+  mutable SnapshotView view;
+  mutable unsigned long long version;
+};
+
+} // namespace mxprops
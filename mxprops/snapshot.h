@@ -0,0 +1,240 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+#pragma once
+#include "mxprops.h"
+#include <boost/cstdint.hpp>
+#include <limits>
+
+
+namespace mxprops {
+
+namespace detail {
+
+class MappedFile;
+
+// the snapshot file contents for src, see save_snapshot()
+void make_snapshot(PTree::ConstRef const& src, std::string & image);
+
+// Layout of a snapshot file, in the byte order of the writer:
+// header, string table, node table, string data.
+// Nodes are stored breadth first, so the children of a node are
+// consecutive and sorted by name like in PTree.
+
+struct SnapshotHeader
+{
+  char magic[4];                 // "MXPS"
+  boost::uint32_t formatVersion;
+  boost::uint32_t byteOrder;     // 0x01020304 as written
+  boost::uint32_t nodeCount;
+  boost::uint32_t stringCount;
+  boost::uint32_t reserved;
+  boost::uint64_t stringsOffset; // from the beginning of the file
+  boost::uint64_t nodesOffset;
+  boost::uint64_t dataOffset;
+  boost::uint64_t dataSize;
+};
+
+struct SnapshotString
+{
+  boost::uint32_t offset;        // in the string data
+  boost::uint32_t size;
+};
+
+struct SnapshotNode
+{
+  enum Flags { present = 1, defined = 2 };
+  enum Kind { text = 0, integer = 1, real = 2 };
+
+  boost::uint32_t name;          // string index, none for the root
+  boost::uint32_t parent;
+  boost::uint32_t firstChild;
+  boost::uint32_t childCount;
+  boost::uint32_t value;         // string index
+  boost::uint8_t flags;
+  boost::uint8_t kind;           // of the value, parsed when saved
+  boost::uint16_t reserved;
+  union
+  {
+    boost::int64_t integer;
+    double real;
+  } number;
+};
+
+// Reads a number without parsing the value string, when the snapshot
+// already holds it and the result is the same as PTree would give.
+template <typename TData>
+struct SnapshotNumber
+{
+  static boost::optional<TData> load(SnapshotNode const&)
+  {
+    return boost::optional<TData>();
+  }
+};
+
+template <typename TData>
+struct SnapshotInteger
+{
+  static boost::optional<TData> load(SnapshotNode const& n)
+  {
+    if (n.kind != SnapshotNode::integer)
+      return boost::optional<TData>();
+    boost::int64_t const v = n.number.integer;
+    if (v < 0 ? v < boost::int64_t(std::numeric_limits<TData>::min())
+              : boost::uint64_t(v) > boost::uint64_t(std::numeric_limits<TData>::max()))
+      return boost::optional<TData>();
+    return TData(v);
+  }
+};
+
+template <> struct SnapshotNumber<int> : SnapshotInteger<int> { };
+template <> struct SnapshotNumber<long> : SnapshotInteger<long> { };
+template <> struct SnapshotNumber<long long> : SnapshotInteger<long long> { };
+template <> struct SnapshotNumber<unsigned> : SnapshotInteger<unsigned> { };
+template <> struct SnapshotNumber<unsigned long> : SnapshotInteger<unsigned long> { };
+
+template <>
+struct SnapshotNumber<double>
+{
+  static boost::optional<double> load(SnapshotNode const& n)
+  {
+    if (n.kind == SnapshotNode::real)
+      return n.number.real;
+    // exactly representable, so the same as parsing the text
+    boost::int64_t const exact = boost::int64_t(1) << 53;
+    if (n.kind == SnapshotNode::integer && n.number.integer <= exact && n.number.integer >= -exact)
+      return double(n.number.integer);
+    return boost::optional<double>();
+  }
+};
+
+} // namespace detail
+
+
+// Read-only access to a snapshot file written by save_snapshot().
+// The file is mapped into memory and used in place: opening costs next to
+// nothing regardless of the size, and processes reading the same snapshot
+// share its pages. Lookups follow the same rules as PTree::ConstRef.
+//
+// A view may be read from several threads. Snapshots are replaced by
+// renaming, so an open view keeps reading the file it has opened.
+class SnapshotView
+{
+public:
+  static size_t const npos = size_t(-1);
+
+  SnapshotView();
+
+  // @return false if the file cannot be read or is not a snapshot
+  bool open(std::string const& filename, std::vector<std::string> & messages);
+
+  // the same for a POSIX shared memory object, see SharedConfigPublisher
+  bool openShared(std::string const& name, std::vector<std::string> & messages);
+  bool isOpen() const { return nodes != 0; }
+
+  // @return the node of the path or npos
+  size_t find(std::string const& path) const;
+
+  bool isDefined(std::string const& path) const
+  {
+    size_t const id = find(path);
+    return id != npos && (nodes[id].flags & detail::SnapshotNode::defined);
+  }
+
+  // the value as stored in the file, empty if undefined
+  boost::string_ref getString(std::string const& path) const
+  {
+    size_t const id = find(path);
+    if (id == npos || !(nodes[id].flags & detail::SnapshotNode::defined))
+      return boost::string_ref();
+    return string(nodes[id].value);
+  }
+
+  template <typename TData>
+  boost::optional<TData> getOptional(const std::string &path, bool *getDefined = 0) const
+  {
+    size_t const id = find(path);
+    bool const defined = id != npos && (nodes[id].flags & detail::SnapshotNode::defined);
+    if (getDefined)
+      *getDefined = defined;
+    if (!defined)
+      return boost::optional<TData>();
+    boost::optional<TData> const number = detail::SnapshotNumber<TData>::load(nodes[id]);
+    if (number)
+      return number;
+    typedef typename detail::Translator<TData>::type Tr;
+    boost::string_ref const s = string(nodes[id].value);
+    return Tr().get_value(std::string(s.data(), s.size()));
+  }
+
+  template <typename TData>
+  TData get(const std::string &path, const TData &defaultValue) const
+  {
+    return getOptional<TData>(path).get_value_or(defaultValue);
+  }
+
+  template <typename TData>
+  TData get(const std::string &path) const
+  {
+    bool isDefined = false;
+    boost::optional<TData> const v = getOptional<TData>(path, &isDefined);
+    if (!v)
+      throw PropsError(path, isDefined ? "Bad format " : "Undefined property: ");
+    return *v;
+  }
+
+  // names of the children of path, including those without keys
+  std::vector<boost::string_ref> listChildren(std::string const& path) const;
+
+  // copies the snapshot below path into dst as a single write
+  void copyTo(PTree::Ref const& dst, std::string const& path = "") const;
+
+private:
+  bool attach(boost::shared_ptr<detail::MappedFile> const& f,
+              std::string const& source,
+              std::vector<std::string> & messages);
+
+  boost::string_ref string(boost::uint32_t index) const
+  {
+    if (index >= stringCount || strings[index].offset > dataSize
+        || strings[index].size > dataSize - strings[index].offset)
+      return boost::string_ref();
+    return boost::string_ref(data + strings[index].offset, strings[index].size);
+  }
+
+  boost::shared_ptr<detail::MappedFile> file;
+  detail::SnapshotNode const* nodes;
+  size_t nodeCount;
+  detail::SnapshotString const* strings;
+  size_t stringCount;
+  char const* data;
+  size_t dataSize;
+};
+
+} // namespace mxprops
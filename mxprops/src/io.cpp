@@ -1,9 +1,10 @@
 #define MXPROPS_EXPORTS
 #include "../io.h"
 #include <json-cpp/value.h>
-#include <json-cpp/reader.h>
+#include "mapped_file.h"
 #include <sstream>
-#include <fstream>
+#include <cctype>
+#include <cstring>
 #include <boost/algorithm/string/trim.hpp>
 
 
@@ -57,94 +58,699 @@ bool load_from_command_line(mxprops::PTree::Ref const& dst,
   }
 }
 
+// appends the decimal representation of i
+static void append_index(std::string & path, size_t i)
+{
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  do
+  {
+    *--p = char('0' + i % 10);
+    i /= 10;
+  } while (i != 0);
+  path.append(p, buf + sizeof(buf));
+}
+
+static void enter(std::string & path, std::string const& key)
+{
+  if (!path.empty())
+    path += '.';
+  path += key;
+}
+
+// With numericArrays, arrays of numbers are stored as a single record (see
+// PTree::Record::setArray()), of int if all elements are ints and of
+// double otherwise. Integers beyond int are kept as written instead,
+// with a key per element.
+// @return false if v is not such an array
+static bool stage_numeric_array(mxprops::PTree::Batch & batch,
+                                std::string const& path,
+                                Json::Value const& v)
+{
+  if (v.empty())
+    return false;
+  bool integral = true;
+  for (Json::Value::const_iterator it = v.begin(); it != v.end(); ++it)
+  {
+    if (it->type() == Json::realValue)
+      integral = false;
+    else if ((it->type() != Json::intValue && it->type() != Json::uintValue) || !it->isInt())
+      return false;
+  }
+  if (integral)
+  {
+    std::vector<int> ints;
+    for (Json::Value::const_iterator it = v.begin(); it != v.end(); ++it)
+      ints.push_back(it->asInt());
+    batch.setArray(path, ints);
+  }
+  else
+  {
+    std::vector<double> reals;
+    for (Json::Value::const_iterator it = v.begin(); it != v.end(); ++it)
+      reals.push_back(it->asDouble());
+    batch.setArray(path, reals);
+  }
+  return true;
+}
+
+// the path of each value is built in place, one string for the whole document
+static bool stage_json(mxprops::PTree::Batch & batch,
+                       std::vector<std::string> & messages,
+                       std::string & path,
+                       Json::Value const& v,
+                       bool numericArrays)
+{
+  size_t const base = path.size();
+  switch (v.type())
+  {
+  case Json::arrayValue:
+    if (numericArrays && stage_numeric_array(batch, path, v))
+      return true;
+    // fall through
+  case Json::objectValue:
+    {
+      size_t index = 0;
+      for (Json::Value::const_iterator it = v.begin(); it != v.end(); ++it, ++index)
+      {
+        if (v.type() == Json::objectValue)
+          enter(path, it.key().asString());
+        else
+        {
+          if (!path.empty())
+            path += '.';
+          append_index(path, index);
+        }
+        bool const ok = stage_json(batch, messages, path, *it, numericArrays);
+        path.resize(base);
+        if (!ok)
+          return false;
+      }
+      return true;
+    }
+
+  case Json::nullValue:
+    batch.undefine(path);
+    return true;
+
+  case Json::intValue:
+    batch.set(path, v.asInt());
+    return true;
+  case Json::uintValue:
+    batch.set(path, v.asUInt());
+    return true;
+  case Json::realValue:
+    batch.set(path, v.asDouble());
+    return true;
+  case Json::stringValue:
+    batch.set(path, v.asString());
+    return true;
+  case Json::booleanValue:
+    batch.set<int>(path, v.asBool());
+    return true;
+
+  default:
+    messages.push_back("unknown value type");
+    return false;
+  }
+}
+
 bool load_from_json(mxprops::PTree::Ref const& dst,
                     std::vector<std::string> & messages,
-                    Json::Value const& doc)
+                    Json::Value const& doc,
+                    bool numericArrays)
 {
-  std::vector<std::string> members = doc.getMemberNames();
-  for (size_t i = 0; i < members.size(); ++i)
+  mxprops::PTree::Batch batch(dst);
+  std::string path;
+  if (!stage_json(batch, messages, path, doc, numericArrays))
+    return false;
+  batch.commit();
+  return true;
+}
+
+
+namespace {
+
+struct JsonSyntaxError
+{
+  char const* pos;
+  char const* what;
+};
+
+// Single pass JSON reader writing values straight into a batch,
+// without building a document. Accepts comments like Json::Reader does.
+class JsonStreamLoader
+{
+public:
+  JsonStreamLoader(char const* begin, char const* end, mxprops::PTree::Batch & batch,
+                   bool numericArrays)
+  : p(begin),
+    end(end),
+    batch(batch),
+    numericArrays(numericArrays)
+  { }
+
+  // throws JsonSyntaxError
+  void load()
   {
-    std::string const& n = members[i];
-    Json::Value const& v = doc[n];
-    Json::ValueType const ty = v.type();
+    skipSpace();
+    if (p == end || *p != '{')
+      fail("expected an object");
+    parseValue(0);
+    skipSpace();
+    if (p != end)
+      fail("unexpected data after the document");
+  }
 
-    switch (ty)
-    {
-    case Json::objectValue:
-      if (!load_from_json(dst.getSubtree(n), messages, v))
-        return false;
-      break;
+private:
+  enum { maxDepth = 1000 };
 
-    case Json::arrayValue:
+  void fail(char const* what) const
+  {
+    JsonSyntaxError const e = { p, what };
+    throw e;
+  }
+
+  void skipSpace()
+  {
+    while (p != end)
+    {
+      if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        ++p;
+      else if (*p == '/' && end - p > 1 && p[1] == '/')
+      {
+        while (p != end && *p != '\n')
+          ++p;
+      }
+      else if (*p == '/' && end - p > 1 && p[1] == '*')
       {
-        Json::Value objv(Json::objectValue);
-        for (size_t ai = 0; ai < v.size(); ++ai)
-          objv[boost::lexical_cast<std::string>(ai)] = v[ai];
-        return load_from_json(dst, messages, objv);
+        char const* const start = p;
+        for (p += 2; ; ++p)
+        {
+          if (end - p < 2)
+          {
+            p = start;
+            fail("unterminated comment");
+          }
+          if (p[0] == '*' && p[1] == '/')
+            break;
+        }
+        p += 2;
       }
+      else
+        return;
+    }
+  }
 
-    case Json::nullValue:
-      dst.undefine(n);
-      break;
+  void expect(char c, char const* what)
+  {
+    skipSpace();
+    if (p == end || *p != c)
+      fail(what);
+    ++p;
+  }
 
-    case Json::intValue:
-      dst.set(n, v.asInt());
+  void literal(char const* word)
+  {
+    size_t const n = std::strlen(word);
+    if (size_t(end - p) < n || std::memcmp(p, word, n) != 0)
+      fail("unknown value");
+    p += n;
+  }
+
+  // the value is stored at the current path
+  void parseValue(int depth)
+  {
+    skipSpace();
+    if (p == end)
+      fail("unexpected end of data");
+    switch (*p)
+    {
+    case '{':
+    case '[':
+      if (depth == maxDepth)
+        fail("too deeply nested");
+      if (*p == '[' && numericArrays && parseNumericArray())
+        break;
+      parseContainer(depth + 1);
       break;
-    case Json::uintValue:
-      dst.set(n, v.asUInt());
+    case '"':
+      parseString(value);
+      batch.set(path, value);
       break;
-    case Json::realValue:
-      dst.set(n, v.asDouble());
+    case 't':
+      literal("true");
+      batch.set<int>(path, 1);
       break;
-    case Json::stringValue:
-      dst.set(n, v.asString());
+    case 'f':
+      literal("false");
+      batch.set<int>(path, 0);
       break;
-    case Json::booleanValue:
-      dst.set<int>(n, v.asBool());
+    case 'n':
+      literal("null");
+      batch.undefine(path);
       break;
-
     default:
-      messages.push_back("unknown value type");
-      return false;
+      parseNumber();
     }
   }
+
+  void parseContainer(int depth)
+  {
+    bool const isObject = *p++ == '{';
+    char const close = isObject ? '}' : ']';
+    size_t const base = path.size();
+    skipSpace();
+    if (p != end && *p == close)
+    {
+      ++p;
+      return;
+    }
+    for (size_t index = 0; ; ++index)
+    {
+      if (isObject)
+      {
+        skipSpace();
+        if (p == end || *p != '"')
+          fail("expected a member name");
+        parseString(key);
+        enter(path, key);
+        expect(':', "expected ':' after a member name");
+      }
+      else
+      {
+        if (base != 0)
+          path += '.';
+        append_index(path, index);
+      }
+      parseValue(depth);
+      path.resize(base);
+
+      skipSpace();
+      if (p == end)
+        fail("unexpected end of data");
+      if (*p == close)
+      {
+        ++p;
+        return;
+      }
+      if (*p != ',')
+        fail(isObject ? "expected ',' or '}'" : "expected ',' or ']'");
+      ++p;
+    }
+  }
+
+  // Stores an array of numbers as a single record, see stage_numeric_array().
+  // @return false with nothing consumed if the array holds anything else
+  bool parseNumericArray()
+  {
+    char const* const start = p++;
+    ints.clear();
+    reals.clear();
+    bool integral = true;
+    for (;;)
+    {
+      skipSpace();
+      if (p == end || (*p != '-' && !std::isdigit(static_cast<unsigned char>(*p))))
+        break;
+      char const* const number = p;
+      if (scanNumber())
+      {
+        int i;
+        if (!mxprops::detail::parseInteger(number, p, i))
+          break;
+        ints.push_back(i);
+        reals.push_back(i);
+      }
+      else
+      {
+        integral = false;
+        reals.push_back(parseReal(number));
+      }
+      skipSpace();
+      if (p != end && *p == ']')
+      {
+        ++p;
+        if (integral)
+          batch.setArray(path, ints);
+        else
+          batch.setArray(path, reals);
+        return true;
+      }
+      if (p == end || *p != ',')
+        break;
+      ++p;
+    }
+    p = start;
+    return false;
+  }
+
+  static int hexDigit(char c)
+  {
+    if (c >= '0' && c <= '9')
+      return c - '0';
+    if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+    return -1;
+  }
+
+  unsigned parseHex4()
+  {
+    if (end - p < 4)
+      fail("bad unicode escape");
+    unsigned r = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+      int const d = hexDigit(*p++);
+      if (d < 0)
+        fail("bad unicode escape");
+      r = r * 16 + unsigned(d);
+    }
+    return r;
+  }
+
+  static void appendUtf8(std::string & s, unsigned c)
+  {
+    if (c < 0x80)
+      s += char(c);
+    else if (c < 0x800)
+    {
+      s += char(0xC0 | (c >> 6));
+      s += char(0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000)
+    {
+      s += char(0xE0 | (c >> 12));
+      s += char(0x80 | ((c >> 6) & 0x3F));
+      s += char(0x80 | (c & 0x3F));
+    }
+    else
+    {
+      s += char(0xF0 | (c >> 18));
+      s += char(0x80 | ((c >> 12) & 0x3F));
+      s += char(0x80 | ((c >> 6) & 0x3F));
+      s += char(0x80 | (c & 0x3F));
+    }
+  }
+
+  void parseString(std::string & s)
+  {
+    s.clear();
+    char const* const start = p++;
+    for (;;)
+    {
+      char const* run = p;
+      while (p != end && *p != '"' && *p != '\\')
+        ++p;
+      s.append(run, p);
+      if (p == end)
+      {
+        p = start;
+        fail("unterminated string");
+      }
+      if (*p++ == '"')
+        return;
+
+      if (p == end)
+        fail("unterminated string");
+      switch (*p++)
+      {
+      case '"':  s += '"';  break;
+      case '\\': s += '\\'; break;
+      case '/':  s += '/';  break;
+      case 'b':  s += '\b'; break;
+      case 'f':  s += '\f'; break;
+      case 'n':  s += '\n'; break;
+      case 'r':  s += '\r'; break;
+      case 't':  s += '\t'; break;
+      case 'u':
+        {
+          unsigned c = parseHex4();
+          if (c >= 0xD800 && c < 0xDC00)
+          {
+            if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+              fail("bad unicode surrogate pair");
+            p += 2;
+            unsigned const low = parseHex4();
+            if (low < 0xDC00 || low >= 0xE000)
+              fail("bad unicode surrogate pair");
+            c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+          }
+          appendUtf8(s, c);
+          break;
+        }
+      default:
+        --p;
+        fail("bad escape sequence");
+      }
+    }
+  }
+
+  void parseNumber()
+  {
+    char const* const start = p;
+    if (scanNumber())
+    {
+      // kept as written, not limited to the range of int
+      value.assign(start, p);
+      batch.set(path, value);
+      return;
+    }
+    batch.set(path, parseReal(start));
+  }
+
+  // skips a number, @return whether it is an integer
+  bool scanNumber()
+  {
+    char const* const start = p;
+    bool integral = true;
+    if (p != end && *p == '-')
+      ++p;
+    if (p == end || !std::isdigit(static_cast<unsigned char>(*p)))
+    {
+      p = start;
+      fail("unknown value");
+    }
+    while (p != end && std::isdigit(static_cast<unsigned char>(*p)))
+      ++p;
+    if (p != end && *p == '.')
+    {
+      integral = false;
+      ++p;
+      while (p != end && std::isdigit(static_cast<unsigned char>(*p)))
+        ++p;
+    }
+    if (p != end && (*p == 'e' || *p == 'E'))
+    {
+      integral = false;
+      ++p;
+      if (p != end && (*p == '+' || *p == '-'))
+        ++p;
+      while (p != end && std::isdigit(static_cast<unsigned char>(*p)))
+        ++p;
+    }
+    return integral;
+  }
+
+  // the number from start to p
+  double parseReal(char const* start)
+  {
+    value.assign(start, p);
+    boost::optional<double> const d = mxprops::detail::Translator<double>::type().get_value(value);
+    if (!d)
+    {
+      p = start;
+      fail("bad number");
+    }
+    return *d;
+  }
+
+  char const* p;
+  char const* const end;
+  mxprops::PTree::Batch & batch;
+  bool const numericArrays;
+  std::string path;
+  std::string key;    // buffers reused for every value
+  std::string value;
+  std::vector<int> ints;
+  std::vector<double> reals;
+};
+
+} // namespace
+
+// reports a syntax error with the line and column of pos
+static void add_syntax_error(std::vector<std::string> & messages,
+                             std::string const& source,
+                             char const* begin,
+                             JsonSyntaxError const& e)
+{
+  size_t line = 1, column = 1;
+  for (char const* c = begin; c != e.pos; ++c)
+  {
+    if (*c == '\n')
+    {
+      line++;
+      column = 1;
+    }
+    else
+      column++;
+  }
+  std::ostringstream oss;
+  oss << "Failed to parse json " << source << ": line " << line
+      << ", column " << column << ": " << e.what;
+  messages.push_back(oss.str());
+}
+
+static bool stage_json_range(mxprops::PTree::Batch & batch,
+                             std::vector<std::string> & messages,
+                             std::string const& source,
+                             char const* begin,
+                             char const* end,
+                             bool numericArrays)
+{
+  try
+  {
+    JsonStreamLoader(begin, end, batch, numericArrays).load();
+  }
+  catch (JsonSyntaxError const& e)
+  {
+    add_syntax_error(messages, source, begin, e);
+    batch.clear();
+    return false;
+  }
   return true;
 }
 
+static bool stage_json_file(mxprops::PTree::Batch & batch,
+                            std::vector<std::string> & messages,
+                            std::string const& filename,
+                            bool numericArrays = false)
+{
+  detail::MappedFile file;
+  if (!file.open(filename))
+  {
+    messages.push_back("Failed to open json file " + filename);
+    return false;
+  }
+  return stage_json_range(batch, messages, "file " + filename,
+                          file.data(), file.data() + file.size(), numericArrays);
+}
+
+bool load_from_json_text(mxprops::PTree::Ref const& dst,
+                         std::vector<std::string> & messages,
+                         std::string const& text,
+                         bool numericArrays)
+{
+  mxprops::PTree::Batch batch(dst);
+  if (!stage_json_range(batch, messages, "text", text.data(), text.data() + text.size(), numericArrays))
+    return false;
+  batch.commit();
+  return true;
+}
 
 bool load_from_json_file(mxprops::PTree::Ref const& dst,
                          std::vector<std::string> & messages,
-                         std::string const& filename)
+                         std::string const& filename,
+                         bool numericArrays)
 {
-  Json::Reader reader;
-  Json::Value doc(Json::objectValue);
-  std::ifstream f(filename.c_str());
-  if (!f.is_open() || !reader.parse(f, doc))
-  {
-    messages.push_back("Failed to parse json file " + filename + ": "
-                       + reader.getFormatedErrorMessages());
+  mxprops::PTree::Batch batch(dst);
+  if (!stage_json_file(batch, messages, filename, numericArrays))
     return false;
+  batch.commit();
+  return true;
+}
+
+namespace {
+
+struct StagedFile
+{
+  StagedFile(mxprops::PTree::Ref const& dst, char const* filename)
+  : filename(filename)
+  , batch(dst)
+  , ok(false)
+  { }
+
+  char const* filename;
+  mxprops::PTree::Batch batch;
+  std::vector<std::string> messages;
+  bool ok;
+};
+
+// stages files taken from a shared counter until none are left
+class StagingWorker
+{
+public:
+  StagingWorker(std::vector<StagedFile> & files, boost::atomic<size_t> & next)
+  : files(files)
+  , next(next)
+  { }
+
+  void operator()() const
+  {
+    for (size_t i = next++; i < files.size(); i = next++)
+    {
+      StagedFile & f = files[i];
+      try
+      {
+        f.ok = stage_json_file(f.batch, f.messages, f.filename);
+      }
+      catch (std::exception const& e)
+      {
+        f.messages.push_back(e.what());
+      }
+    }
   }
-  return load_from_json(dst, messages, doc);
+
+private:
+  std::vector<StagedFile> & files;
+  boost::atomic<size_t> & next;
+};
+
+// parses the files concurrently, each into its own batch
+void stage_json_files(std::vector<StagedFile> & files)
+{
+  boost::atomic<size_t> next(0);
+  size_t const threads = std::min<size_t>(files.size(), std::max(1u, boost::thread::hardware_concurrency()));
+  boost::thread_group group;
+  for (size_t i = 1; i < threads; ++i)
+    group.create_thread(StagingWorker(files, next));
+  StagingWorker(files, next)();
+  group.join_all();
 }
 
+} // namespace
+
 void init_settings_from_command_line(mxprops::PTree::Ref const& dst,
                                      int argc,
                                      char const* argv[])
 {
-  std::vector<std::string> messages;
+  // json files are parsed up front and in parallel, then applied together
+  // with the property lines in the order of arguments, so later ones win
+  std::vector<StagedFile> files;
+  for (int i = 1; i < argc; ++i)
+    if (argv[i][0] != '-')
+      files.push_back(StagedFile(dst, argv[i]));
+  stage_json_files(files);
 
+  std::vector<StagedFile>::iterator file = files.begin();
   for (int i = 1; i < argc; ++i)
   {
     if (argv[i][0] == '-')
     {
       add_prop_line(dst, argv[i] + 1);
     }
-    else if (!load_from_json_file(dst, messages, argv[i]))
+    else
     {
-      std::ostringstream oss;
-      oss << "unknown arg #" << i << ": '" << argv[i] << "'";
-      throw std::runtime_error(oss.str());
+      StagedFile & f = *file++;
+      if (!f.ok)
+      {
+        std::ostringstream oss;
+        oss << "unknown arg #" << i << ": '" << argv[i] << "'";
+        throw std::runtime_error(oss.str());
+      }
+      f.batch.commit();
     }
   }
 }
@@ -0,0 +1,115 @@
+#pragma once
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <fstream>
+#include <iterator>
+#if defined(__unix__) || defined(__APPLE__)
+# define MXPROPS_HAVE_MMAP
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+
+namespace mxprops {
+namespace detail {
+
+// Read-only view of a whole file: mapped into memory where possible,
+// read into a buffer elsewhere.
+class MappedFile : private boost::noncopyable
+{
+public:
+  MappedFile()
+  : ptr(0),
+    len(0),
+    mapped(false)
+  { }
+
+  ~MappedFile()
+  {
+#ifdef MXPROPS_HAVE_MMAP
+    if (mapped)
+      munmap(const_cast<char *>(ptr), len);
+#endif
+  }
+
+  bool open(std::string const& filename)
+  {
+#ifdef MXPROPS_HAVE_MMAP
+    int const fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+    bool regular = false;
+    bool const ok = map(fd, regular);
+    ::close(fd);
+    if (!ok)
+      return false;
+    if (mapped || (regular && len == 0))
+    {
+# ifdef MADV_SEQUENTIAL
+      if (mapped)
+        madvise(const_cast<char *>(ptr), len, MADV_SEQUENTIAL);
+# endif
+      return true;
+    }
+    len = 0;
+#endif
+    std::ifstream f(filename.c_str(), std::ios::binary);
+    if (!f.is_open())
+      return false;
+    buffer.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    ptr = buffer.data();
+    len = buffer.size();
+    return true;
+  }
+
+  // a POSIX shared memory object, see shm_open()
+  bool openShared(std::string const& name)
+  {
+#ifdef MXPROPS_HAVE_MMAP
+    int const fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      return false;
+    bool regular = false;
+    bool const ok = map(fd, regular);
+    ::close(fd);
+    return ok && mapped;
+#else
+    (void)name;
+    return false;
+#endif
+  }
+
+  char const* data() const { return ptr; }
+  size_t size() const { return len; }
+
+private:
+#ifdef MXPROPS_HAVE_MMAP
+  // maps the whole of fd unless it is empty or not a regular file
+  bool map(int fd, bool & regular)
+  {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      return false;
+    regular = S_ISREG(st.st_mode);
+    len = regular ? size_t(st.st_size) : 0;
+    if (len == 0)
+      return true;
+    void *const p = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      return true;
+    ptr = static_cast<char const*>(p);
+    mapped = true;
+    return true;
+  }
+#endif
+
+  char const* ptr;
+  size_t len;
+  bool mapped;
+  std::string buffer;
+};
+
+} // namespace detail
+} // namespace mxprops
@@ -0,0 +1,341 @@
+#define MXPROPS_EXPORTS
+#include "../reload.h"
+#include "../io.h"
+#include <boost/bind/bind.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <map>
+#include <set>
+#ifdef __linux__
+# include <sys/inotify.h>
+# include <poll.h>
+# include <unistd.h>
+# include <fcntl.h>
+#endif
+
+
+namespace mxprops {
+
+// Waits for changes of a set of files.
+// Whole directories are watched, since editors tend to replace files
+// instead of writing them in place.
+class ConfigReloader::FileWatch : private boost::noncopyable
+{
+public:
+  FileWatch(std::vector<std::string> const& files)
+  : files(files),
+    stopping(false)
+#ifdef __linux__
+    , notifyFd(-1)
+#endif
+  {
+#ifdef __linux__
+    wakePipe[0] = wakePipe[1] = -1;
+    // without the pipe stop() could not wake up poll(), so polling it is
+    if (pipe(wakePipe) == 0)
+    {
+      fcntl(wakePipe[0], F_SETFD, FD_CLOEXEC);
+      fcntl(wakePipe[1], F_SETFD, FD_CLOEXEC);
+      notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    else
+      wakePipe[0] = wakePipe[1] = -1;
+    std::set<std::string> dirs;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+      names.insert(baseName(files[i]));
+      dirs.insert(dirName(files[i]));
+    }
+    for (std::set<std::string>::const_iterator it = dirs.begin(); notifyFd >= 0 && it != dirs.end(); ++it)
+      if (inotify_add_watch(notifyFd, it->c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0)
+      {
+        close(notifyFd);
+        notifyFd = -1;
+      }
+#endif
+    mtimes = readMtimes();
+  }
+
+  ~FileWatch()
+  {
+#ifdef __linux__
+    if (notifyFd >= 0)
+      close(notifyFd);
+    if (wakePipe[0] >= 0)
+      close(wakePipe[0]);
+    if (wakePipe[1] >= 0)
+      close(wakePipe[1]);
+#endif
+  }
+
+  // @return false when stopped
+  bool waitForChange(unsigned quietMilliseconds)
+  {
+#ifdef __linux__
+    if (notifyFd >= 0)
+    {
+      while (!waitForEvents(-1))
+        if (isStopping())
+          return false;
+      // let the writer finish
+      while (waitForEvents(int(quietMilliseconds)))
+        ;
+      return !isStopping();
+    }
+#endif
+    for (;;)
+    {
+      if (!sleep(pollMilliseconds))
+        return false;
+      std::vector<long> const m = readMtimes();
+      if (m != mtimes)
+      {
+        mtimes = m;
+        if (!sleep(quietMilliseconds))
+          return false;
+        mtimes = readMtimes();
+        return true;
+      }
+    }
+  }
+
+  void stop()
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    stopping = true;
+    stopped.notify_all();
+#ifdef __linux__
+    if (wakePipe[1] >= 0)
+    {
+      char const c = 0;
+      // the reader is woken up anyway or already gone if this fails
+      ssize_t const n = write(wakePipe[1], &c, 1);
+      (void)n;
+    }
+#endif
+  }
+
+private:
+  static unsigned const pollMilliseconds = 500;
+
+  static std::string baseName(std::string const& path)
+  {
+    size_t const pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+  }
+
+  static std::string dirName(std::string const& path)
+  {
+    size_t const pos = path.find_last_of("/\\");
+    if (pos == std::string::npos)
+      return ".";
+    return pos == 0 ? "/" : path.substr(0, pos);
+  }
+
+  std::vector<long> readMtimes() const
+  {
+    std::vector<long> result(files.size(), -1);
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+      struct stat st;
+      if (stat(files[i].c_str(), &st) == 0)
+        result[i] = long(st.st_mtime);
+    }
+    return result;
+  }
+
+  bool isStopping()
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    return stopping;
+  }
+
+  // @return false when stopped
+  bool sleep(unsigned milliseconds)
+  {
+    boost::unique_lock<boost::mutex> g(mutex);
+    if (!stopping)
+      stopped.timed_wait(g, boost::posix_time::millisec(milliseconds));
+    return !stopping;
+  }
+
+#ifdef __linux__
+  // @return true if one of the files was touched; false on timeout or stop
+  bool waitForEvents(int timeoutMilliseconds)
+  {
+    pollfd fds[2] = { { notifyFd, POLLIN, 0 }, { wakePipe[0], POLLIN, 0 } };
+    if (poll(fds, 2, timeoutMilliseconds) <= 0 || (fds[1].revents & POLLIN))
+      return false;
+
+    bool relevant = false;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(notifyFd, buf, sizeof(buf))) > 0)
+    {
+      for (char *p = buf; p < buf + len; )
+      {
+        inotify_event const* e = reinterpret_cast<inotify_event const*>(p);
+        if (e->len > 0 && names.count(e->name))
+          relevant = true;
+        p += sizeof(inotify_event) + e->len;
+      }
+    }
+    return relevant;
+  }
+#endif
+
+  std::vector<std::string> const files;
+  std::vector<long> mtimes;
+
+  boost::mutex mutex;
+  boost::condition_variable stopped;
+  bool stopping;
+
+#ifdef __linux__
+  int notifyFd;
+  int wakePipe[2];
+  std::set<std::string> names;
+#endif
+};
+
+
+ConfigReloader::ConfigReloader(PTree::Ref const& dst, unsigned quietMilliseconds)
+: dst(dst),
+  quietMilliseconds(quietMilliseconds),
+  current(new PTree()),
+  reloadCount(0)
+{ }
+
+ConfigReloader::~ConfigReloader()
+{
+  stop();
+}
+
+void ConfigReloader::addFile(std::string const& filename)
+{
+  Source const s = { true, filename };
+  sources.push_back(s);
+}
+
+void ConfigReloader::addOverride(std::string const& propLine)
+{
+  Source const s = { false, propLine };
+  sources.push_back(s);
+}
+
+bool ConfigReloader::loadSources(PTree::Ref const& staging, std::vector<std::string> & msgs) const
+{
+  for (size_t i = 0; i < sources.size(); ++i)
+  {
+    if (sources[i].isFile)
+    {
+      if (!load_from_json_file(staging, msgs, sources[i].text))
+        return false;
+    }
+    else
+    {
+      std::string const arg = "-" + sources[i].text;
+      char const* argv[] = { "", arg.c_str() };
+      if (!load_from_command_line(staging, msgs, 2, argv))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool ConfigReloader::reload()
+{
+  // parse and apply as one, so that a manual reload racing the watcher
+  // cannot apply an older parse after a newer one
+  boost::lock_guard<boost::mutex> r(reloadMutex);
+  boost::scoped_ptr<PTree> next(new PTree());
+  std::vector<std::string> msgs;
+  if (!loadSources(next->root(""), msgs))
+  {
+    boost::lock_guard<boost::mutex> g(mutex);
+    messages.swap(msgs);
+    return false;
+  }
+
+  boost::lock_guard<boost::mutex> g(mutex);
+
+  // what differs from the live tree, which others may have written to
+  // since the previous reload; keys are collected first so that two trees
+  // are never locked together
+  typedef std::map<std::string, PTree::Record> records_t;
+  records_t nextKeys, live;
+  std::vector<std::string> prevKeys;
+  for (PTree::SubtreeIterator it(next->root(""), true); !it.atEnd(); it.next())
+    nextKeys.insert(std::make_pair(it.path(), it.record()));
+  for (PTree::SubtreeIterator it(current->root("")); !it.atEnd(); it.next())
+    if (!nextKeys.count(it.path()))
+      prevKeys.push_back(it.path());
+  std::set<std::string> const removed(prevKeys.begin(), prevKeys.end());
+  for (PTree::SubtreeIterator it(dst); !it.atEnd(); it.next())
+  {
+    std::string const path = it.path();
+    if (nextKeys.count(path) || removed.count(path))
+      live.insert(std::make_pair(path, it.record()));
+  }
+
+  PTree delta;
+  PTree::Ref const d = delta.root("");
+  for (records_t::const_iterator it = nextKeys.begin(); it != nextKeys.end(); ++it)
+  {
+    PTree::Record const& r = it->second;
+    records_t::const_iterator const old = live.find(it->first);
+    if (r.isDefined() ? old == live.end() || old->second.getValue() != r.getValue() : old != live.end())
+      d.setRecord(it->first, r);
+  }
+  // only keys loaded before are undefined, the others belong to someone else
+  for (size_t i = 0; i < prevKeys.size(); ++i)
+    if (live.count(prevKeys[i]))
+      d.undefine(prevKeys[i]);
+
+  dst.merge(delta.root(""));
+  current.swap(next);
+  messages.clear();
+  reloadCount++;
+  return true;
+}
+
+void ConfigReloader::start()
+{
+  if (thread.joinable())
+    return;
+  std::vector<std::string> files;
+  for (size_t i = 0; i < sources.size(); ++i)
+    if (sources[i].isFile)
+      files.push_back(sources[i].text);
+  watch.reset(new FileWatch(files));
+  thread = boost::thread(boost::bind(&ConfigReloader::run, this));
+}
+
+void ConfigReloader::stop()
+{
+  if (!thread.joinable())
+    return;
+  watch->stop();
+  thread.join();
+  watch.reset();
+}
+
+void ConfigReloader::run()
+{
+  while (watch->waitForChange(quietMilliseconds))
+    reload();
+}
+
+std::vector<std::string> ConfigReloader::getMessages() const
+{
+  boost::lock_guard<boost::mutex> g(mutex);
+  return messages;
+}
+
+unsigned long ConfigReloader::getReloadCount() const
+{
+  boost::lock_guard<boost::mutex> g(mutex);
+  return reloadCount;
+}
+
+} // namespace mxprops
@@ -0,0 +1,249 @@
+#define MXPROPS_EXPORTS
+#include "../shared.h"
+#include "mapped_file.h"
+#include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/static_assert.hpp>
+#include <cerrno>
+#include <cstring>
+
+
+namespace mxprops {
+
+namespace detail {
+
+// contents of the control object, written by the publisher only
+struct SharedControl
+{
+  char magic[4];                 // "MXPC", written last
+  boost::uint32_t formatVersion;
+  boost::atomic<boost::uint64_t> version;  // of the current snapshot, 0 if none
+};
+
+} // namespace detail
+
+// readers in other processes rely on the atomic being lock-free
+BOOST_STATIC_ASSERT(BOOST_ATOMIC_INT64_LOCK_FREE == 2);
+
+static boost::uint32_t const sharedFormatVersion = 1;
+
+static std::string snapshot_name(std::string const& name, unsigned long long version)
+{
+  return name + "." + boost::lexical_cast<std::string>(version);
+}
+
+#ifdef MXPROPS_HAVE_MMAP
+
+static void unmap_control(detail::SharedControl const* c)
+{
+  munmap(const_cast<detail::SharedControl *>(c), sizeof(*c));
+}
+
+static bool write_all(int fd, char const* data, size_t size)
+{
+  while (size != 0)
+  {
+    ssize_t const n = ::write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= size_t(n);
+  }
+  return true;
+}
+
+#endif
+
+
+SharedConfigPublisher::SharedConfigPublisher()
+: control(0),
+  version(0)
+{ }
+
+SharedConfigPublisher::~SharedConfigPublisher()
+{
+  close();
+}
+
+void SharedConfigPublisher::close()
+{
+#ifdef MXPROPS_HAVE_MMAP
+  if (control)
+    unmap_control(control);
+#endif
+  control = 0;
+}
+
+bool SharedConfigPublisher::open(std::string const& name, std::vector<std::string> & messages)
+{
+  close();
+#ifdef MXPROPS_HAVE_MMAP
+  int const fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0
+      || (size_t(st.st_size) < sizeof(detail::SharedControl)
+          && ftruncate(fd, sizeof(detail::SharedControl)) != 0))
+  {
+    if (fd >= 0)
+      ::close(fd);
+    messages.push_back("Failed to create shared config " + name + ": " + std::strerror(errno));
+    return false;
+  }
+  void *const p = mmap(0, sizeof(detail::SharedControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED)
+  {
+    messages.push_back("Failed to map shared config " + name);
+    return false;
+  }
+  control = static_cast<detail::SharedControl *>(p);
+  this->name = name;
+  if (std::memcmp(control->magic, "MXPC", 4) == 0 && control->formatVersion == sharedFormatVersion)
+  {
+    // continues after a previous publisher
+    version = control->version.load();
+    return true;
+  }
+  // new, zero filled
+  version = 0;
+  control->formatVersion = sharedFormatVersion;
+  control->version.store(0);
+  boost::atomic_thread_fence(boost::memory_order_release);
+  std::memcpy(control->magic, "MXPC", 4);
+  return true;
+#else
+  messages.push_back("Shared memory is not supported, cannot create " + name);
+  return false;
+#endif
+}
+
+bool SharedConfigPublisher::publish(PTree::ConstRef const& src, std::vector<std::string> & messages)
+{
+  if (!control)
+  {
+    messages.push_back("Shared config is not open");
+    return false;
+  }
+#ifdef MXPROPS_HAVE_MMAP
+  std::string image;
+  detail::make_snapshot(src, image);
+
+  unsigned long long const next = version + 1;
+  std::string const next_name = snapshot_name(name, next);
+  shm_unlink(next_name.c_str());  // left over from a publisher that died
+  int const fd = shm_open(next_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+  {
+    messages.push_back("Failed to create shared snapshot " + next_name + ": " + std::strerror(errno));
+    return false;
+  }
+  bool const ok = ftruncate(fd, off_t(image.size())) == 0 && write_all(fd, image.data(), image.size());
+  ::close(fd);
+  if (!ok)
+  {
+    shm_unlink(next_name.c_str());
+    messages.push_back("Failed to write shared snapshot " + next_name);
+    return false;
+  }
+
+  // readers that have not mapped the previous one yet will see the new version
+  control->version.store(next);
+  if (version != 0)
+    shm_unlink(snapshot_name(name, version).c_str());
+  version = next;
+  return true;
+#else
+  (void)src;
+  return false;
+#endif
+}
+
+void SharedConfigPublisher::unlink()
+{
+#ifdef MXPROPS_HAVE_MMAP
+  if (name.empty())
+    return;
+  shm_unlink(name.c_str());
+  if (version != 0)
+    shm_unlink(snapshot_name(name, version).c_str());
+#endif
+}
+
+
+SharedConfigView::SharedConfigView()
+: version(0)
+{ }
+
+bool SharedConfigView::open(std::string const& name, std::vector<std::string> & messages)
+{
+  control.reset();
+  view = SnapshotView();
+  version = 0;
+#ifdef MXPROPS_HAVE_MMAP
+  int const fd = shm_open(name.c_str(), O_RDONLY, 0);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(detail::SharedControl))
+  {
+    if (fd >= 0)
+      ::close(fd);
+    messages.push_back("No shared config " + name);
+    return false;
+  }
+  void *const p = mmap(0, sizeof(detail::SharedControl), PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED)
+  {
+    messages.push_back("Failed to map shared config " + name);
+    return false;
+  }
+  boost::shared_ptr<detail::SharedControl const> c(static_cast<detail::SharedControl const*>(p), unmap_control);
+  if (std::memcmp(c->magic, "MXPC", 4) != 0)
+  {
+    messages.push_back("No shared config " + name);
+    return false;
+  }
+  boost::atomic_thread_fence(boost::memory_order_acquire);
+  if (c->formatVersion != sharedFormatVersion)
+  {
+    messages.push_back("Unsupported shared config format: " + name);
+    return false;
+  }
+  control = c;
+  this->name = name;
+  snapshot();
+  return true;
+#else
+  messages.push_back("Shared memory is not supported, cannot open " + name);
+  return false;
+#endif
+}
+
+SnapshotView const& SharedConfigView::snapshot() const
+{
+  if (!control)
+    return view;
+  for (;;)
+  {
+    unsigned long long const current = control->version.load();
+    if (current == version)
+      return view;
+    if (current == 0)
+      break;
+    SnapshotView next;
+    std::vector<std::string> messages;
+    if (next.openShared(snapshot_name(name, current), messages))
+    {
+      view = next;
+      version = current;
+      return view;
+    }
+    // replaced and removed meanwhile unless the version stays the same
+    if (control->version.load() == current)
+      break;
+  }
+  return view;
+}
+
+} // namespace mxprops
@@ -0,0 +1,378 @@
+#define MXPROPS_EXPORTS
+#include "../snapshot.h"
+#include "../io.h"
+#include "mapped_file.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+
+namespace mxprops {
+
+static boost::uint32_t const snapshotFormatVersion = 1;
+static boost::uint32_t const snapshotByteOrder = 0x01020304;
+static boost::uint32_t const noString = boost::uint32_t(-1);
+
+namespace {
+
+// the saved keys as a tree, built from their paths
+struct SaveNode
+{
+  SaveNode()
+  : present(false)
+  { }
+
+  std::map<std::string, size_t> children;
+  std::string name;
+  bool present;
+  PTree::Record record;
+};
+
+class StringTable
+{
+public:
+  boost::uint32_t add(std::string const& s)
+  {
+    std::map<std::string, boost::uint32_t>::iterator const it = index.find(s);
+    if (it != index.end())
+      return it->second;
+    detail::SnapshotString const e = { boost::uint32_t(data.size()), boost::uint32_t(s.size()) };
+    entries.push_back(e);
+    data += s;
+    return index[s] = boost::uint32_t(entries.size() - 1);
+  }
+
+  std::vector<detail::SnapshotString> entries;
+  std::string data;
+
+private:
+  std::map<std::string, boost::uint32_t> index;
+};
+
+// parsed once here, so that readers of the snapshot do not have to
+void set_number(detail::SnapshotNode & n, std::string const& value)
+{
+  typedef detail::Translator<boost::int64_t>::type IntTr;
+  typedef detail::Translator<double>::type RealTr;
+  boost::optional<boost::int64_t> const i = IntTr().get_value(value);
+  if (i)
+  {
+    n.kind = detail::SnapshotNode::integer;
+    n.number.integer = *i;
+    return;
+  }
+  boost::optional<double> const d = RealTr().get_value(value);
+  if (d)
+  {
+    n.kind = detail::SnapshotNode::real;
+    n.number.real = *d;
+  }
+}
+
+} // namespace
+
+
+namespace detail {
+
+void make_snapshot(PTree::ConstRef const& src, std::string & image)
+{
+  std::vector<SaveNode> tree(1);
+  for (PTree::SubtreeIterator it(src, true); !it.atEnd(); it.next())
+  {
+    std::string const path = it.path();
+    size_t id = 0;
+    for (size_t begin = 0; !path.empty(); )
+    {
+      size_t const end = std::min(path.find('.', begin), path.size());
+      std::string const name = path.substr(begin, end - begin);
+      std::map<std::string, size_t>::iterator c = tree[id].children.find(name);
+      if (c == tree[id].children.end())
+      {
+        c = tree[id].children.insert(std::make_pair(name, tree.size())).first;
+        tree.push_back(SaveNode());
+        tree.back().name = name;
+      }
+      id = c->second;
+      if (end == path.size())
+        break;
+      begin = end + 1;
+    }
+    tree[id].present = true;
+    if (tree[id].record.isDefined())
+      continue;  // an element of an array, which hides the key
+    tree[id].record = it.record();
+
+    // arrays are saved as a key per element, which the view can look up
+    detail::ArrayData const* a = it.record().getArrayData();
+    if (!a)
+      continue;
+    tree[id].record = PTree::Record();
+    for (size_t i = 0; i < a->size(); ++i)
+    {
+      std::string const name = boost::lexical_cast<std::string>(i);
+      std::map<std::string, size_t>::iterator c = tree[id].children.find(name);
+      if (c == tree[id].children.end())
+      {
+        c = tree[id].children.insert(std::make_pair(name, tree.size())).first;
+        tree.push_back(SaveNode());
+        tree.back().name = name;
+      }
+      SaveNode & element = tree[c->second];
+      element.present = true;
+      element.record.setValue(a->element(i));
+    }
+  }
+
+  // breadth first, so that children are consecutive
+  std::vector<size_t> order(1, 0);
+  std::vector<detail::SnapshotNode> nodes(tree.size());
+  std::memset(&nodes[0], 0, nodes.size() * sizeof(nodes[0]));
+  StringTable strings;
+  nodes[0].name = noString;
+  for (size_t i = 0; i < order.size(); ++i)
+  {
+    SaveNode const& s = tree[order[i]];
+    detail::SnapshotNode & n = nodes[i];
+    n.firstChild = boost::uint32_t(order.size());
+    n.childCount = boost::uint32_t(s.children.size());
+    for (std::map<std::string, size_t>::const_iterator c = s.children.begin(); c != s.children.end(); ++c)
+    {
+      nodes[order.size()].name = strings.add(c->first);
+      nodes[order.size()].parent = boost::uint32_t(i);
+      order.push_back(c->second);
+    }
+    n.value = noString;
+    if (s.present)
+      n.flags |= detail::SnapshotNode::present;
+    if (s.record.isDefined())
+    {
+      n.flags |= detail::SnapshotNode::defined;
+      n.value = strings.add(s.record.getValue());
+      set_number(n, s.record.getValue());
+    }
+  }
+
+  detail::SnapshotHeader h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, "MXPS", 4);
+  h.formatVersion = snapshotFormatVersion;
+  h.byteOrder = snapshotByteOrder;
+  h.nodeCount = boost::uint32_t(nodes.size());
+  h.stringCount = boost::uint32_t(strings.entries.size());
+  h.stringsOffset = sizeof(h);
+  h.nodesOffset = h.stringsOffset + strings.entries.size() * sizeof(detail::SnapshotString);
+  h.dataOffset = h.nodesOffset + nodes.size() * sizeof(detail::SnapshotNode);
+  h.dataSize = strings.data.size();
+
+  image.clear();
+  image.reserve(size_t(h.dataOffset + h.dataSize));
+  image.append(reinterpret_cast<char const*>(&h), sizeof(h));
+  if (!strings.entries.empty())
+    image.append(reinterpret_cast<char const*>(&strings.entries[0]),
+                 strings.entries.size() * sizeof(detail::SnapshotString));
+  image.append(reinterpret_cast<char const*>(&nodes[0]), nodes.size() * sizeof(detail::SnapshotNode));
+  image.append(strings.data);
+}
+
+} // namespace detail
+
+
+bool save_snapshot(mxprops::PTree::ConstRef const& src,
+                   std::vector<std::string> & messages,
+                   std::string const& filename)
+{
+  std::string image;
+  detail::make_snapshot(src, image);
+
+  // written aside and renamed, so that views of the old file stay intact
+  std::string const tmp = filename + ".tmp";
+  {
+    std::ofstream f(tmp.c_str(), std::ios::binary | std::ios::trunc);
+    f.write(image.data(), image.size());
+    if (!f.good())
+    {
+      messages.push_back("Failed to write snapshot " + tmp);
+      return false;
+    }
+  }
+#ifdef _WIN32
+  std::remove(filename.c_str());
+#endif
+  if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+  {
+    std::remove(tmp.c_str());
+    messages.push_back("Failed to write snapshot " + filename);
+    return false;
+  }
+  return true;
+}
+
+bool load_snapshot(mxprops::PTree::Ref const& dst,
+                   std::vector<std::string> & messages,
+                   std::string const& filename)
+{
+  SnapshotView view;
+  if (!view.open(filename, messages))
+    return false;
+  view.copyTo(dst);
+  return true;
+}
+
+
+size_t const SnapshotView::npos;
+
+SnapshotView::SnapshotView()
+: nodes(0),
+  nodeCount(0),
+  strings(0),
+  stringCount(0),
+  data(0),
+  dataSize(0)
+{ }
+
+bool SnapshotView::open(std::string const& filename, std::vector<std::string> & messages)
+{
+  boost::shared_ptr<detail::MappedFile> f(new detail::MappedFile());
+  if (!f->open(filename))
+  {
+    messages.push_back("Failed to open snapshot " + filename);
+    return false;
+  }
+  return attach(f, filename, messages);
+}
+
+bool SnapshotView::openShared(std::string const& name, std::vector<std::string> & messages)
+{
+  boost::shared_ptr<detail::MappedFile> f(new detail::MappedFile());
+  if (!f->openShared(name))
+  {
+    messages.push_back("Failed to open shared snapshot " + name);
+    return false;
+  }
+  return attach(f, name, messages);
+}
+
+bool SnapshotView::attach(boost::shared_ptr<detail::MappedFile> const& f,
+                          std::string const& filename,
+                          std::vector<std::string> & messages)
+{
+  detail::SnapshotHeader const* const h = reinterpret_cast<detail::SnapshotHeader const*>(f->data());
+  boost::uint64_t const size = f->size();
+  if (size < sizeof(*h) || std::memcmp(h->magic, "MXPS", 4) != 0)
+  {
+    messages.push_back("Not a snapshot: " + filename);
+    return false;
+  }
+  if (h->byteOrder != snapshotByteOrder || h->formatVersion != snapshotFormatVersion)
+  {
+    messages.push_back("Unsupported snapshot format: " + filename);
+    return false;
+  }
+  if (h->nodeCount == 0
+      || h->stringsOffset % 8 != 0 || h->nodesOffset % 8 != 0
+      || h->stringsOffset > size || (size - h->stringsOffset) / sizeof(detail::SnapshotString) < h->stringCount
+      || h->nodesOffset > size || (size - h->nodesOffset) / sizeof(detail::SnapshotNode) < h->nodeCount
+      || h->dataOffset > size || size - h->dataOffset < h->dataSize)
+  {
+    messages.push_back("Corrupted snapshot: " + filename);
+    return false;
+  }
+
+  file = f;
+  strings = reinterpret_cast<detail::SnapshotString const*>(f->data() + h->stringsOffset);
+  stringCount = h->stringCount;
+  nodes = reinterpret_cast<detail::SnapshotNode const*>(f->data() + h->nodesOffset);
+  nodeCount = h->nodeCount;
+  data = f->data() + h->dataOffset;
+  dataSize = size_t(h->dataSize);
+  return true;
+}
+
+size_t SnapshotView::find(std::string const& path) const
+{
+  if (!nodes)
+    return npos;
+  size_t id = 0;
+  boost::string_ref rest(path);
+  while (!rest.empty())
+  {
+    size_t const dot = rest.find('.');
+    boost::string_ref const name = rest.substr(0, dot);
+    rest = dot == boost::string_ref::npos ? boost::string_ref() : rest.substr(dot + 1);
+
+    detail::SnapshotNode const& n = nodes[id];
+    if (n.firstChild > nodeCount || n.childCount > nodeCount - n.firstChild)
+      return npos;
+    size_t lo = n.firstChild, hi = size_t(n.firstChild) + n.childCount;
+    while (lo < hi)
+    {
+      size_t const mid = lo + (hi - lo) / 2;
+      if (string(nodes[mid].name) < name)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == size_t(n.firstChild) + n.childCount || string(nodes[lo].name) != name)
+      return npos;
+    id = lo;
+  }
+  return id;
+}
+
+std::vector<boost::string_ref> SnapshotView::listChildren(std::string const& path) const
+{
+  std::vector<boost::string_ref> result;
+  size_t const id = find(path);
+  if (id == npos)
+    return result;
+  detail::SnapshotNode const& n = nodes[id];
+  if (n.firstChild > nodeCount || n.childCount > nodeCount - n.firstChild)
+    return result;
+  for (size_t i = n.firstChild; i < size_t(n.firstChild) + n.childCount; ++i)
+    result.push_back(string(nodes[i].name));
+  return result;
+}
+
+void SnapshotView::copyTo(PTree::Ref const& dst, std::string const& path) const
+{
+  size_t const base = find(path);
+  if (base == npos)
+    return;
+
+  PTree::Batch batch(dst);
+  // (node, length of its path), depth first
+  std::vector<std::pair<size_t, size_t> > stack(1, std::make_pair(base, size_t(0)));
+  std::string key;
+  while (!stack.empty())
+  {
+    size_t const id = stack.back().first;
+    key.resize(stack.back().second);
+    stack.pop_back();
+
+    detail::SnapshotNode const& n = nodes[id];
+    if (id != base)
+    {
+      boost::string_ref const name = string(n.name);
+      if (!key.empty())
+        key += '.';
+      key.append(name.data(), name.size());
+    }
+    if (n.flags & detail::SnapshotNode::defined)
+    {
+      boost::string_ref const v = string(n.value);
+      batch.set(key, std::string(v.data(), v.size()));
+    }
+    else if (n.flags & detail::SnapshotNode::present)
+      batch.undefine(key);
+
+    if (n.firstChild > nodeCount || n.childCount > nodeCount - n.firstChild
+        || (n.childCount != 0 && n.firstChild <= id))
+      continue;  // corrupted, and a cycle would never end
+    for (size_t i = n.childCount; i-- > 0; )
+      stack.push_back(std::make_pair(size_t(n.firstChild) + i, key.size()));
+  }
+  batch.commit();
+}
+
+} // namespace mxprops
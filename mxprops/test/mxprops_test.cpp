@@ -1,5 +1,17 @@
 #include "gtest/gtest.h"
 #include <mxprops/mxprops.h>
+#include <mxprops/reload.h>
+#include <mxprops/io.h>
+#include <mxprops/snapshot.h>
+#include <mxprops/layered.h>
+#include <mxprops/shared.h>
+#include <json-cpp/value.h>
+#include <cstdio>
+#include <fstream>
+#ifdef __unix__
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
 
 using namespace mxprops;
 
@@ -30,6 +42,948 @@ TEST(MxPropsTest, ConstRoot)
   EXPECT_FALSE(root.getOptional<int>("a_value"));
 }
 
+TEST(MxPropsTest, LookupDoesNotInsert)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("cam.a", 1);
+  root.set("cam-b", 2);
+  root.set("cam", 3);
+
+  EXPECT_FALSE(root.getOptional<int>("cam.missing"));
+  EXPECT_FALSE(root.getSubtree("other").getOptional<int>("x"));
+  EXPECT_EQ(7, root.get<int>("cam.b", 7));
+
+  std::vector<std::string> keys;
+  root.listKeysRecursive(keys, true);
+  EXPECT_EQ(3u, keys.size());
+
+  EXPECT_EQ(1, root.getSubtree("cam").get<int>("a"));
+  EXPECT_EQ(3, root.getSubtree("cam").getValue<int>().get());
+  EXPECT_EQ(2, root.get<int>("cam-b"));
+}
+
+TEST(MxPropsTest, ListKeys)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("cam1.gain", 1);
+  root.set("cam1.roi.x", 2);
+  root.set("cam10.gain", 3);
+  root.undefine("cam1.exposure");
+  root.getSubtree("empty.subtree");
+
+  std::vector<std::string> keys;
+  root.getSubtree("cam1").listKeysRecursive(keys);
+  ASSERT_EQ(2u, keys.size());
+  EXPECT_EQ("gain", keys[0]);
+  EXPECT_EQ("roi.x", keys[1]);
+
+  keys.clear();
+  root.getSubtree("cam1").listKeys(keys, true);
+  ASSERT_EQ(3u, keys.size());
+  EXPECT_EQ("exposure", keys[0]);
+  EXPECT_EQ("gain", keys[1]);
+  EXPECT_EQ("roi", keys[2]);
+
+  keys.clear();
+  root.listKeys(keys);
+  ASSERT_EQ(2u, keys.size());
+  EXPECT_EQ("cam1", keys[0]);
+  EXPECT_EQ("cam10", keys[1]);
+
+  root.undefine("cam10.gain");
+  keys.clear();
+  root.listKeys(keys);
+  EXPECT_EQ(1u, keys.size());
+}
+
+TEST(MxPropsTest, Iterators)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("cam", 0);
+  root.set("cam.a.x", 1);
+  root.set("cam.a.y", 2);
+  root.undefine("cam.b.z");
+  root.set("cam.c", 3);
+  root.getSubtree("cam.d.e");
+
+  std::vector<std::string> keys;
+  for (PTree::ChildIterator it(root.getSubtree("cam")); !it.atEnd(); it.next())
+    keys.push_back(it.key().to_string());
+  ASSERT_EQ(2u, keys.size());
+  EXPECT_EQ("a", keys[0]);
+  EXPECT_EQ("c", keys[1]);
+
+  std::vector<std::string> expected;
+  root.getSubtree("cam").listKeysRecursive(expected, true);
+  keys.clear();
+  int sum = 0;
+  PTree::ConstRef cam = root.getSubtree("cam");
+  for (PTree::SubtreeIterator it(cam, true); !it.atEnd(); it.next())
+  {
+    keys.push_back(it.path());
+    sum += it.get<int>().get_value_or(0);
+  }
+  EXPECT_EQ(expected, keys);
+  EXPECT_EQ(6, sum);
+
+  PTree::ConstRef a;
+  {
+    PTree::ChildIterator it(cam);
+    a = it.ref();
+  }
+  EXPECT_EQ("cam.a", a.getPath());
+  EXPECT_EQ(2, a.get<int>("y"));
+
+  EXPECT_TRUE(PTree::SubtreeIterator(root.getSubtree("missing")).atEnd());
+}
+
+namespace {
+
+struct ChangeLog
+{
+  std::vector<PTree::Changes> *log;
+
+  void operator () (PTree::Changes const& c) const
+  {
+    log->push_back(c);
+  }
+};
+
+} // namespace
+
+TEST(MxPropsTest, Watch)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  std::vector<PTree::Changes> subtree, single;
+  ChangeLog const subtreeLog = { &subtree };
+  ChangeLog const singleLog = { &single };
+  PTree::WatchId const id = root.getSubtree("cam").watch("", subtreeLog);
+  root.watch("cam.gain", singleLog, false);
+
+  root.set("cam.gain", 2);
+  root.set("cam.gain", 2);       // not a change
+  root.set("cam.roi.x", 10);
+  root.set("other", 1);
+  root.undefine("cam.roi.x");
+  root.undefine("cam.missing");  // was not defined either
+
+  ASSERT_EQ(3u, subtree.size());
+  EXPECT_EQ("cam.gain", subtree[0].paths.at(0));
+  EXPECT_EQ("cam.roi.x", subtree[1].paths.at(0));
+  EXPECT_EQ("cam.roi.x", subtree[2].paths.at(0));
+  EXPECT_EQ(tree.getVersion() - 1, subtree[2].version);
+  ASSERT_EQ(1u, single.size());
+
+  root.unwatch(id);
+  tree.clear();
+  root.set("cam.roi.y", 1);
+  EXPECT_EQ(3u, subtree.size());
+  ASSERT_EQ(2u, single.size());
+  EXPECT_EQ("cam.gain", single[1].paths.at(0));
+}
+
+TEST(MxPropsTest, Batch)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  std::vector<PTree::Changes> changes;
+  ChangeLog const log = { &changes };
+  root.watch("calib", log);
+  root.set("calib.old", 1);
+  unsigned long const version = tree.getVersion();
+
+  PTree::Batch b = root.getSubtree("calib").batch();
+  b.set("fx", 500.5);
+  b.set("fy", 501);
+  b.set("fx", 502.5);
+  b.undefine("old");
+  EXPECT_EQ(4u, b.size());
+  EXPECT_FALSE(root.getOptional<double>("calib.fx"));
+  EXPECT_EQ(version, tree.getVersion());
+
+  b.commit();
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(version + 1, tree.getVersion());
+  EXPECT_EQ(502.5, root.get<double>("calib.fx"));
+  EXPECT_EQ(501, root.get<int>("calib.fy"));
+  EXPECT_FALSE(root.getOptional<int>("calib.old"));
+  ASSERT_EQ(2u, changes.size());
+  EXPECT_EQ(3u, changes[1].paths.size());
+
+  b.set("fy", 1);
+  b.clear();
+  b.commit();
+  EXPECT_EQ(version + 1, tree.getVersion());
+  EXPECT_EQ(501, root.get<int>("calib.fy"));
+}
+
+namespace {
+
+void writeFile(std::string const& name, std::string const& text)
+{
+  std::string const tmp = name + ".tmp";
+  {
+    std::ofstream f(tmp.c_str());
+    f << text;
+  }
+  std::rename(tmp.c_str(), name.c_str());
+}
+
+// path=value of every defined property below ref
+std::vector<std::string> dump(PTree::ConstRef const& ref)
+{
+  std::vector<std::string> result;
+  for (PTree::SubtreeIterator it(ref); !it.atEnd(); it.next())
+    result.push_back(it.path() + "=" + it.get<std::string>().get_value_or(""));
+  return result;
+}
+
+} // namespace
+
+TEST(MxPropsTest, Reload)
+{
+  std::string const file = "mxprops_test_reload.json";
+  writeFile(file, "{ \"a\": 1, \"b\": { \"c\": 2 }, \"d\": 3 }");
+
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("cfg.own", 7);
+  std::vector<PTree::Changes> changes;
+  ChangeLog const log = { &changes };
+  root.watch("cfg", log);
+
+  ConfigReloader reloader(root.getSubtree("cfg"), 10);
+  reloader.addFile(file);
+  reloader.addOverride("d=4");
+  ASSERT_TRUE(reloader.reload());
+  EXPECT_EQ(1, root.get<int>("cfg.a"));
+  EXPECT_EQ(2, root.get<int>("cfg.b.c"));
+  EXPECT_EQ(4, root.get<int>("cfg.d"));
+  ASSERT_EQ(1u, changes.size());
+  EXPECT_EQ(3u, changes[0].paths.size());
+
+  reloader.start();
+  writeFile(file, "{ \"a\": 1, \"b\": { \"e\": 5 }, \"d\": 3 }");
+  for (int i = 0; i < 500 && reloader.getReloadCount() < 2; ++i)
+    boost::this_thread::sleep(boost::posix_time::millisec(10));
+  reloader.stop();
+
+  ASSERT_EQ(2u, reloader.getReloadCount());
+  EXPECT_FALSE(root.getOptional<int>("cfg.b.c"));
+  EXPECT_EQ(5, root.get<int>("cfg.b.e"));
+  EXPECT_EQ(4, root.get<int>("cfg.d"));
+  EXPECT_EQ(7, root.get<int>("cfg.own"));
+  ASSERT_EQ(2u, changes.size());
+  EXPECT_EQ(2u, changes[1].paths.size());
+
+  writeFile(file, "{ broken");
+  EXPECT_FALSE(reloader.reload());
+  EXPECT_FALSE(reloader.getMessages().empty());
+  EXPECT_EQ(5, root.get<int>("cfg.b.e"));
+
+  // the live tree is compared, not the previous reload
+  writeFile(file, "{ \"a\": 1, \"b\": { \"e\": 5 }, \"d\": 3 }");
+  root.set("cfg.a", 9);
+  root.set("cfg.own", 8);
+  ASSERT_TRUE(reloader.reload());
+  EXPECT_EQ(1, root.get<int>("cfg.a"));
+  EXPECT_EQ(8, root.get<int>("cfg.own"));
+  ASSERT_EQ(5u, changes.size());
+  EXPECT_EQ(1u, changes[4].paths.size());
+  ASSERT_TRUE(reloader.reload());
+  EXPECT_EQ(5u, changes.size());
+
+  std::remove(file.c_str());
+}
+
+TEST(MxPropsTest, JsonLoader)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  std::vector<std::string> messages;
+  root.set("old", 1);
+  unsigned long const version = tree.getVersion();
+
+  ASSERT_TRUE(load_from_json_text(root.getSubtree("cfg"), messages,
+      "// calibration\n"
+      "{ \"k\": [1, 2.5, [true, null], { \"x\": \"a\\\"b\\u00e9\" }],\n"
+      "  /* after the array */ \"big\": 12345678901234567890,\n"
+      "  \"o\": { \"e\": -1e2, \"f\": false }, \"old\": null }"));
+  EXPECT_EQ(version + 1, tree.getVersion());
+  EXPECT_EQ(1, root.get<int>("cfg.k.0"));
+  EXPECT_EQ(2.5, root.get<double>("cfg.k.1"));
+  EXPECT_EQ(1, root.get<int>("cfg.k.2.0"));
+  EXPECT_FALSE(root.getOptional<int>("cfg.k.2.1"));
+  EXPECT_EQ("a\"b\xc3\xa9", root.get<std::string>("cfg.k.3.x"));
+  EXPECT_EQ("12345678901234567890", root.get<std::string>("cfg.big"));
+  EXPECT_EQ(-100, root.get<int>("cfg.o.e"));
+  EXPECT_EQ(0, root.get<int>("cfg.o.f"));
+  EXPECT_FALSE(root.getOptional<int>("cfg.old"));
+  EXPECT_EQ(1, root.get<int>("old"));
+
+  EXPECT_FALSE(load_from_json_text(root, messages, "{ \"old\": 2,\n  \"k\" 3 }"));
+  ASSERT_EQ(1u, messages.size());
+  EXPECT_EQ("Failed to parse json text: line 2, column 7: expected ':' after a member name", messages[0]);
+  EXPECT_EQ(1, root.get<int>("old"));
+
+  Json::Value doc(Json::objectValue);
+  doc["a"][0u] = 1;
+  doc["a"][1u]["b"] = "c";
+  doc["z"] = 2;
+  ASSERT_TRUE(load_from_json(root.getSubtree("dom"), messages, doc));
+  EXPECT_EQ(1, root.get<int>("dom.a.0"));
+  EXPECT_EQ("c", root.get<std::string>("dom.a.1.b"));
+  EXPECT_EQ(2, root.get<int>("dom.z"));
+}
+
+TEST(MxPropsTest, Snapshot)
+{
+  std::string const file = "mxprops_test.snapshot";
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("cfg.cam.fx", 500.25);
+  root.set("cfg.cam.id", -3);
+  root.set("cfg.cam.big", "3000000000");
+  root.set("cfg.name", "front");
+  root.set("cfg.on", true);
+  root.undefine("cfg.gone");
+  root.set("other", 1);
+  std::vector<std::string> messages;
+  ASSERT_TRUE(save_snapshot(root.getSubtree("cfg"), messages, file));
+
+  SnapshotView view;
+  ASSERT_TRUE(view.open(file, messages));
+  EXPECT_EQ(500.25, view.get<double>("cam.fx"));
+  EXPECT_EQ(-3, view.get<int>("cam.id"));
+  EXPECT_EQ(-3.0, view.get<double>("cam.id"));
+  EXPECT_EQ(root.getOptional<unsigned>("cfg.cam.id"), view.getOptional<unsigned>("cam.id"));
+  EXPECT_FALSE(view.getOptional<int>("cam.big"));
+  EXPECT_EQ(3000000000u, view.get<unsigned>("cam.big"));
+  EXPECT_EQ("front", view.get<std::string>("name"));
+  EXPECT_EQ(boost::string_ref("front"), view.getString("name"));
+  EXPECT_TRUE(view.get<bool>("on"));
+  EXPECT_FALSE(view.isDefined("gone"));
+  EXPECT_FALSE(view.isDefined("other"));
+  EXPECT_EQ(SnapshotView::npos, view.find("cam.fy"));
+  EXPECT_THROW(view.get<int>("name"), PropsError);
+  ASSERT_EQ(3u, view.listChildren("cam").size());
+  EXPECT_EQ("big", view.listChildren("cam")[0]);
+
+  PTree loaded;
+  PTree::Ref dst = loaded.root("my_root");
+  dst.set("gone", 1);
+  ASSERT_TRUE(load_snapshot(dst, messages, file));
+  EXPECT_EQ(2u, loaded.getVersion());
+  EXPECT_EQ(500.25, dst.get<double>("cam.fx"));
+  EXPECT_EQ("front", dst.get<std::string>("name"));
+  EXPECT_FALSE(dst.getOptional<int>("gone"));
+  std::vector<std::string> saved, copied;
+  root.getSubtree("cfg").listKeysRecursive(saved, true);
+  dst.listKeysRecursive(copied, true);
+  EXPECT_EQ(saved, copied);
+
+  // the open view keeps the file it has mapped
+  root.set("cfg.name", "rear");
+  ASSERT_TRUE(save_snapshot(root.getSubtree("cfg"), messages, file));
+  EXPECT_EQ("front", view.get<std::string>("name"));
+  ASSERT_TRUE(view.open(file, messages));
+  EXPECT_EQ("rear", view.get<std::string>("name"));
+
+  writeFile(file, "{}");
+  EXPECT_FALSE(view.open(file, messages));
+  EXPECT_FALSE(load_snapshot(dst, messages, file));
+  EXPECT_TRUE(messages.size() == 2);
+  EXPECT_EQ("rear", view.get<std::string>("name"));
+  std::remove(file.c_str());
+}
+
+TEST(MxPropsTest, Profiling)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("cfg.a", 1);
+  EXPECT_FALSE(tree.isProfiling());
+  EXPECT_TRUE(tree.getProfile().keys.empty());
+
+  tree.setProfiling(true);
+  root.set("cfg.b", 2);
+  root.set("cfg.unused", 3);
+  for (int i = 0; i < 3; ++i)
+    root.get<int>("cfg.a");
+  root.get("cfg.none", 0);
+  root.get("cfg.none", 0);
+  root.getSubtree("cfg").get("b", 0);
+  PTree::ConstPropHandle<int> const h = root.getHandle<int>("cfg.handled");
+  h.get(0);
+
+  PTree::Profile p = tree.getProfile();
+  ASSERT_EQ(5u, p.keys.size());
+  EXPECT_EQ("cfg.a", p.keys[0].path);
+  EXPECT_EQ(3u, p.keys[0].reads);
+  EXPECT_EQ(0u, p.keys[0].writes);
+  EXPECT_EQ("cfg.b", p.keys[1].path);
+  EXPECT_EQ(1u, p.keys[1].reads);
+  EXPECT_EQ(1u, p.keys[1].writes);
+  EXPECT_EQ("cfg.none", p.keys[2].path);
+  EXPECT_EQ(2u, p.keys[2].misses);
+  EXPECT_FALSE(p.keys[2].defined);
+  ASSERT_EQ(2u, p.missing.size());
+  EXPECT_EQ("cfg.handled", p.missing[0]);
+  EXPECT_EQ("cfg.none", p.missing[1]);
+  ASSERT_EQ(1u, p.unused.size());
+  EXPECT_EQ("cfg.unused", p.unused[0]);
+
+  // counts survive clear()
+  tree.clear();
+  root.get("cfg.a", 0);
+  p = tree.getProfile();
+  ASSERT_FALSE(p.keys.empty());
+  EXPECT_EQ("cfg.a", p.keys[0].path);
+  EXPECT_EQ(4u, p.keys[0].reads);
+  EXPECT_EQ(1u, p.keys[0].misses);
+
+  tree.resetProfile();
+  EXPECT_TRUE(tree.getProfile().keys.empty());
+  tree.setProfiling(false);
+  root.get("cfg.a", 0);
+  EXPECT_TRUE(tree.getProfile().keys.empty());
+}
+
+#ifdef MXPROPS_HAS_PROP_KEYS
+
+static constexpr PropKey scaleKey = "detector.scale"_prop;
+static_assert(scaleKey.size() == 2, "segments are counted at compile time");
+static_assert(scaleKey.segment(1).offset == 9 && scaleKey.segment(1).length == 5,
+              "segments are split at compile time");
+
+TEST(MxPropsTest, PropKeys)
+{
+  EXPECT_EQ(detail::segmentHash("scale"), scaleKey.segment(1).hash);
+
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("detector.scale", 1.5);
+  EXPECT_EQ(1.5, root.get<double>(scaleKey));
+  EXPECT_EQ(1.5, root.getSubtree("detector").get<double>("scale"_prop));
+  EXPECT_EQ(7, root.get("detector.missing"_prop, 7));
+  EXPECT_THROW(root.get<int>("detector"_prop), PropsError);
+
+  root.set(scaleKey, 2.5);
+  EXPECT_EQ(2.5, root.get<double>("detector.scale"));
+
+  // deeper than the hashed segments, and partly existing
+  root.set("a.b.c.d.e.f.g.h.i.j", 1);
+  root.set("a.b.c.d.e.f.g.h.i.k"_prop, 2);
+  root.set("a.b.x"_prop, 3);
+  EXPECT_EQ(1, root.get<int>("a.b.c.d.e.f.g.h.i.j"_prop));
+  EXPECT_EQ(2, root.get<int>("a.b.c.d.e.f.g.h.i.k"));
+  EXPECT_EQ(3, root.get<int>("a.b.x"));
+  EXPECT_FALSE(root.getOptional<int>("a.b.c.d.e.f.g.h.i.z"_prop));
+
+  // lookups by name and by hash see the same nodes after clear()
+  tree.clear();
+  root.set(scaleKey, 3.5);
+  EXPECT_EQ(3.5, root.get<double>("detector.scale"));
+  root.set("detector.gain", 4);
+  EXPECT_EQ(4, root.get<int>("detector.gain"_prop));
+
+  // child lists that outgrow their range while those of siblings grow too
+  for (int i = 99; i >= 0; --i)
+  {
+    root.set("detector.k" + std::to_string(i), i);
+    root.set("other.k" + std::to_string(i), -i);
+  }
+  EXPECT_EQ(3.5, root.get<double>(scaleKey));
+  EXPECT_EQ(42, root.get<int>("detector.k42"_prop));
+  EXPECT_EQ(-42, root.get<int>("other.k42"));
+  std::vector<std::string> keys;
+  root.getSubtree("detector").listKeys(keys);
+  ASSERT_EQ(102u, keys.size());
+  EXPECT_EQ("gain", keys[0]);
+  EXPECT_EQ("k0", keys[1]);
+  EXPECT_EQ("scale", keys.back());
+}
+
+#endif
+
+TEST(MxPropsTest, TypedCache)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("x", 1.5);
+  EXPECT_EQ(1.5, root.get<double>("x"));
+  EXPECT_EQ(1.5, root.get<double>("x"));
+  EXPECT_FALSE(root.getOptional<int>("x"));
+  EXPECT_EQ(1.5, root.get<double>("x"));
+
+  root.set("x", 2);
+  EXPECT_EQ(2, root.get<int>("x"));
+  EXPECT_EQ(2.0, root.get<double>("x"));
+  EXPECT_EQ(2, root.get<int>("x"));
+
+  root.set<std::string>("x", "true");
+  EXPECT_TRUE(root.get<bool>("x"));
+  root.undefine("x");
+  EXPECT_FALSE(root.getOptional<bool>("x"));
+}
+
+TEST(MxPropsTest, Handles)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  PTree::PropHandle<double> scale = root.getSubtree("detector").getHandle<double>("roi.scale");
+  PTree::ConstPropHandle<int> count = root.getHandle<int>("count");
+  EXPECT_FALSE(scale.getOptional());
+  EXPECT_EQ(3, count.get(3));
+
+  scale.set(0.5);
+  for (int i = 0; i < 100; ++i)
+    root.set("other." + boost::lexical_cast<std::string>(i), i);
+  root.set("count", 7);
+  EXPECT_EQ(0.5, scale.get());
+  EXPECT_EQ(0.5, root.get<double>("detector.roi.scale"));
+  EXPECT_EQ(7, count.get());
+
+  scale.undefine();
+  EXPECT_THROW(scale.get(), PropsError);
+
+  // reading through handles and subtrees inserts nothing
+  unsigned long const version = tree.getVersion();
+  PTree const& constTree = tree;
+  PTree::ConstPropHandle<int> const later = constTree.root("my_root").getHandle<int>("missing.a");
+  EXPECT_FALSE(later.getOptional());
+  EXPECT_FALSE(root.getSubtree("missing.b").getOptional<int>("c"));
+  std::vector<std::string> keys;
+  root.listKeys(keys, true);
+  EXPECT_TRUE(std::find(keys.begin(), keys.end(), "missing") == keys.end());
+  EXPECT_EQ(version, tree.getVersion());
+  root.getSubtree("missing.b").set("c", 1);
+  EXPECT_EQ(1, root.get<int>("missing.b.c"));
+  root.set("missing.a", 5);
+  EXPECT_EQ(5, later.get());
+
+  tree.clear();
+  root.set("count", 8);
+  root.set("missing.a", 6);
+  EXPECT_FALSE(count.getOptional());
+  EXPECT_EQ(6, later.get());   // never bound, read by path
+  EXPECT_THROW(scale.set(1.0), PropsError);
+}
+
+namespace {
+
+struct SnapshotReader
+{
+  PTree::ConstRef root;
+  bool *consistent;
+
+  void operator () () const
+  {
+    for (int i = 0; i < 20000; ++i)
+    {
+      // both keys are always written together
+      int const a = root.get<int>("a", -1);
+      int const b = root.get<int>("b", -1);
+      if (b < a)
+        *consistent = false;
+    }
+  }
+};
+
+} // namespace
+
+TEST(MxPropsTest, SnapshotReads)
+{
+  PTree::Options options;
+  options.snapshotReads = true;
+  PTree tree(options);
+  PTree::Ref root = tree.root("my_root");
+  root.set("a", 0);
+  root.set("b", 0);
+
+  bool consistent[4] = { true, true, true, true };
+  boost::thread_group readers;
+  for (int i = 0; i < 4; ++i)
+  {
+    SnapshotReader r = { root, &consistent[i] };
+    readers.create_thread(r);
+  }
+  for (int i = 1; i <= 200; ++i)
+  {
+    root.set("b", i); // b is written first, so a reader never sees b < a
+    root.set("a", i);
+  }
+  readers.join_all();
+
+  for (int i = 0; i < 4; ++i)
+    EXPECT_TRUE(consistent[i]);
+  EXPECT_EQ(200, root.get<int>("a"));
+  EXPECT_EQ(200, root.getHandle<int>("b").get());
+  EXPECT_EQ(402u, tree.getVersion());
+
+  // more keys than a chunk and a page hold, snapshots share the unchanged ones
+  for (int i = 0; i < 5000; ++i)
+    root.set("many." + boost::lexical_cast<std::string>(i), i);
+  for (int i = 0; i < 5000; i += 7)
+    root.set("many." + boost::lexical_cast<std::string>(i), -i);
+  bool same = true;
+  for (int i = 0; i < 5000; ++i)
+    same = same && root.get<int>("many." + boost::lexical_cast<std::string>(i)) == (i % 7 ? i : -i);
+  EXPECT_TRUE(same);
+  std::vector<std::string> keys;
+  root.getSubtree("many").listKeys(keys);
+  EXPECT_EQ(5000u, keys.size());
+}
+
+namespace {
+
+struct StripedWriter
+{
+  PTree::Ref cam;
+
+  void operator () () const
+  {
+    PTree::PropHandle<int> count = cam.getHandle<int>("count");
+    for (int i = 1; i <= 2000; ++i)
+    {
+      cam.set("frames", i);
+      count.set(i);
+      if (i % 2)
+        cam.undefine("flag");
+      else
+        cam.set("flag", i);
+      if (i % 100 == 0)
+        cam.set("new" + boost::lexical_cast<std::string>(i), i); // locks the whole tree
+    }
+  }
+};
+
+} // namespace
+
+TEST(MxPropsTest, StripedWrites)
+{
+  PTree::Options options;
+  options.stripeDepth = 2;
+  PTree tree(options);
+  PTree::Ref root = tree.root("my_root");
+  root.set("stats", 0);
+
+  boost::thread_group writers;
+  for (int i = 0; i < 4; ++i)
+  {
+    StripedWriter w = { root.getSubtree("stats.cam" + boost::lexical_cast<std::string>(i)) };
+    writers.create_thread(w);
+  }
+  int last = 0;
+  bool monotonic = true;
+  for (int i = 0; i < 200; ++i)
+  {
+    std::vector<std::string> keys;
+    root.listKeysRecursive(keys);
+    int const frames = root.get<int>("stats.cam1.frames", 0);
+    monotonic = monotonic && frames >= last;
+    last = frames;
+  }
+  writers.join_all();
+  EXPECT_TRUE(monotonic);
+
+  std::vector<std::string> keys;
+  root.listKeysRecursive(keys);
+  EXPECT_EQ(1u + 4 * (3 + 20), keys.size());
+  for (int i = 0; i < 4; ++i)
+  {
+    PTree::ConstRef cam = root.getSubtree("stats.cam" + boost::lexical_cast<std::string>(i));
+    EXPECT_EQ(2000, cam.get<int>("frames"));
+    EXPECT_EQ(2000, cam.get<int>("count"));
+    EXPECT_EQ(2000, cam.get<int>("flag"));
+    EXPECT_EQ(1900, cam.get<int>("new1900"));
+  }
+  EXPECT_EQ(1 + 4 * (3 * 2000 + 20), int(tree.getVersion()));
+
+  // with watchers, writes lock the whole tree and notify as usual
+  std::vector<PTree::Changes> changes;
+  ChangeLog const log = { &changes };
+  root.watch("stats.cam1", log);
+  root.set("stats.cam1.frames", 1);
+  root.set("stats.cam2.frames", 1);
+  ASSERT_EQ(1u, changes.size());
+  EXPECT_EQ("stats.cam1.frames", changes[0].paths.at(0));
+}
+
+TEST(MxPropsTest, Layered)
+{
+  PTree defaults, group, overrides;
+  defaults.root("cam").set("calib.fx", 500);
+  defaults.root("cam").set("calib.fy", 501);
+  defaults.root("cam").set("gain", 1);
+  defaults.root("cam").set("name", "default");
+  group.root("cam").set("gain", 2);
+  PTree::Ref const over0 = overrides.root("cams").getSubtreeForSubId("cam0", "cam0");
+  PTree::Ref const over1 = overrides.root("cams").getSubtreeForSubId("cam1", "cam1");
+  over0.set("calib.fx", 600);
+  over0.set("calib.cx", 320);
+
+  LayeredRef const base = LayeredRef(defaults.root("cam")).overlay(group.root("cam"));
+  LayeredRef const cam0 = base.overlay(over0);
+  LayeredRef const cam1 = base.overlay(over1);
+  EXPECT_EQ("cams.cam0", cam0.getId());
+  EXPECT_EQ(3u, cam0.layerCount());
+
+  EXPECT_EQ(600, cam0.get<int>("calib.fx"));
+  EXPECT_EQ(500, cam1.get<int>("calib.fx"));
+  EXPECT_EQ(501, cam0.get<int>("calib.fy"));
+  EXPECT_EQ(2, cam0.get<int>("gain"));
+  EXPECT_EQ("default", cam0.get<std::string>("name"));
+  EXPECT_EQ(0u, cam0.findLayer("calib.cx"));
+  EXPECT_EQ(1u, cam0.findLayer("gain"));
+  EXPECT_TRUE(cam1.findLayer("calib.cx") == LayeredRef::npos);
+  EXPECT_FALSE(cam1.getOptional<int>("calib.cx"));
+  EXPECT_THROW(cam0.get<int>("name"), PropsError);
+  EXPECT_EQ(600, cam0.getSubtree("calib").get<int>("fx"));
+  EXPECT_EQ(600, cam0.getRecord("calib.fx").peek_as<int>().get());
+
+  std::vector<std::string> keys;
+  cam0.listKeysRecursive(keys);
+  char const* const expected[] = { "calib.cx", "calib.fx", "calib.fy", "gain", "name" };
+  EXPECT_EQ(std::vector<std::string>(expected, expected + 5), keys);
+
+  // plans follow writes to any layer
+  defaults.root("cam").set("calib.fy", 502);
+  EXPECT_EQ(502, cam0.get<int>("calib.fy"));
+  over0.undefine("calib.fx");
+  EXPECT_EQ(500, cam0.get<int>("calib.fx"));
+  EXPECT_EQ(2u, cam0.findLayer("calib.fx"));
+  over1.set("gain", 3);
+  EXPECT_EQ(3, cam1.get<int>("gain"));
+  EXPECT_EQ(2, cam0.get<int>("gain"));
+  group.root("cam").set("calib.fx", 550);
+  EXPECT_EQ(550, cam0.get<int>("calib.fx"));
+  EXPECT_EQ(1u, cam0.getSubtree("calib").findLayer("fx"));
+
+  // plans are bounded, dropped ones are made again
+  for (int i = 0; i < 100000; ++i)
+    EXPECT_TRUE(cam0.findLayer("missing." + boost::lexical_cast<std::string>(i)) == LayeredRef::npos);
+  EXPECT_EQ(0u, cam0.findLayer("calib.cx"));
+  EXPECT_EQ(320, cam0.get<int>("calib.cx"));
+}
+
+#ifdef __unix__
+TEST(MxPropsTest, SharedConfig)
+{
+  std::string const name = "/mxprops_test_" + boost::lexical_cast<std::string>(getpid());
+  PTree tree;
+  PTree::Ref root = tree.root("cfg");
+  root.set("rate", 25);
+  root.set("cam.name", "left");
+
+  std::vector<std::string> messages;
+  SharedConfigPublisher publisher;
+  ASSERT_TRUE(publisher.open(name, messages));
+  SharedConfigView view;
+  ASSERT_TRUE(view.open(name, messages));
+  EXPECT_FALSE(view.getOptional<int>("rate"));
+  ASSERT_TRUE(publisher.publish(root, messages));
+  EXPECT_EQ(25, view.get<int>("rate"));
+  SnapshotView const first = view.snapshot();
+
+  pid_t const child = fork();
+  if (child == 0)
+  {
+    // another process, waiting for the next version
+    SharedConfigView other;
+    std::vector<std::string> m;
+    if (!other.open(name, m))
+      _exit(1);
+    for (int i = 0; i < 5000 && other.get<int>("rate", 0) != 30; ++i)
+      usleep(1000);
+    _exit(other.get<int>("rate", 0) == 30 && other.get<std::string>("cam.name", "") == "right" ? 0 : 2);
+  }
+  ASSERT_GT(child, 0);
+  root.set("rate", 30);
+  root.set("cam.name", "right");
+  ASSERT_TRUE(publisher.publish(root, messages));
+  int status = 0;
+  ASSERT_EQ(child, waitpid(child, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  EXPECT_EQ(30, view.get<int>("rate"));
+  EXPECT_EQ(2u, view.getVersion());
+  EXPECT_EQ(25, first.get<int>("rate"));  // the old mapping outlives its name
+
+  publisher.unlink();
+  SharedConfigView gone;
+  EXPECT_FALSE(gone.open(name, messages));
+}
+#endif
+
+TEST(MxPropsTest, Translators)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  root.set("i", -2147483647 - 1);
+  EXPECT_EQ("-2147483648", root.get<std::string>("i"));
+  EXPECT_EQ(-2147483647 - 1, root.get<int>("i"));
+  root.set("u", 18446744073709551615ULL);
+  EXPECT_EQ(18446744073709551615ULL, root.get<unsigned long long>("u"));
+  root.set("d", 0.1 + 0.2);
+  EXPECT_EQ(0.1 + 0.2, root.get<double>("d"));
+  root.set("d", 100000.0);
+  EXPECT_EQ("100000", root.get<std::string>("d"));
+  root.set("b", true);
+  EXPECT_EQ("true", root.get<std::string>("b"));
+
+  root.set<std::string>("s", " +42 ");
+  EXPECT_EQ(42, root.get<int>("s"));
+  EXPECT_EQ(42.0, root.get<double>("s"));
+  root.set<std::string>("s", "-1");
+  EXPECT_FALSE(root.getOptional<unsigned>("s"));
+  root.set<std::string>("s", "40000");
+  EXPECT_FALSE(root.getOptional<short>("s"));
+  root.set<std::string>("s", "99999999999999999999");
+  EXPECT_FALSE(root.getOptional<long long>("s"));
+  root.set<std::string>("s", "12x");
+  EXPECT_FALSE(root.getOptional<int>("s"));
+  EXPECT_FALSE(root.getOptional<double>("s"));
+  root.set<std::string>("s", "1");
+  EXPECT_TRUE(root.get<bool>("s"));
+}
+
+TEST(MxPropsTest, CommandLineFiles)
+{
+  std::vector<std::string> names;
+  for (int i = 0; i < 6; ++i)
+  {
+    names.push_back("mxprops_test_cmdline_" + boost::lexical_cast<std::string>(i) + ".json");
+    writeFile(names.back(), "{ \"a\": " + boost::lexical_cast<std::string>(i) +
+                            ", \"f" + boost::lexical_cast<std::string>(i) + "\": { \"b\": [1, 2] } }");
+  }
+  char const* argv[] = { "app", names[0].c_str(), names[1].c_str(), "-a=x", "-c=1",
+                         names[2].c_str(), names[3].c_str(), names[4].c_str(), "-c=2", names[5].c_str() };
+  int const argc = sizeof(argv) / sizeof(argv[0]);
+
+  PTree parallel, sequential;
+  init_settings_from_command_line(parallel.root("r"), argc, argv);
+  std::vector<std::string> messages;
+  for (int i = 1; i < argc; ++i)
+    if (argv[i][0] == '-')
+      ASSERT_TRUE(load_from_command_line(sequential.root("r"), messages, 2, &argv[i - 1]));
+    else
+      ASSERT_TRUE(load_from_json_file(sequential.root("r"), messages, argv[i]));
+
+  EXPECT_EQ(dump(sequential.root("r")), dump(parallel.root("r")));
+  EXPECT_EQ(5, parallel.root("r").get<int>("a"));
+  EXPECT_EQ(2, parallel.root("r").get<int>("c"));
+  EXPECT_EQ(2, parallel.root("r").get<int>("f3.b.1"));
+
+  // files before the broken one are applied, as if loaded one by one
+  writeFile(names[2], "{ broken");
+  PTree partial;
+  EXPECT_THROW(init_settings_from_command_line(partial.root("r"), argc, argv), std::runtime_error);
+  EXPECT_EQ("x", partial.root("r").get<std::string>("a"));
+  EXPECT_FALSE(partial.root("r").getOptional<int>("f2.b.0"));
+  for (size_t i = 0; i < names.size(); ++i)
+    std::remove(names[i].c_str());
+}
+
+TEST(MxPropsTest, Arrays)
+{
+  PTree tree;
+  PTree::Ref root = tree.root("my_root");
+  double const m[] = { 500.5, 0, 320, 0, 501, 240, 0, 0, 1 };
+  root.setArray("cam.K", m, 9);
+  boost::optional<ArrayView<double> > const K = root.getArray<double>("cam.K");
+  ASSERT_TRUE(K);
+  EXPECT_EQ(std::vector<double>(m, m + 9), K->toVector());
+  EXPECT_EQ(K->data(), root.getArray<double>("cam.K")->data());
+  EXPECT_EQ("[500.5, 0, 320, 0, 501, 240, 0, 0, 1]", root.get<std::string>("cam.K"));
+  EXPECT_FALSE(root.getArray<int>("cam.K"));
+  std::vector<std::string> keys;
+  root.listKeysRecursive(keys);
+  EXPECT_EQ(std::vector<std::string>(1, "cam.K"), keys);
+
+  // element paths keep working
+  EXPECT_EQ(320, root.get<int>("cam.K.2"));
+  EXPECT_EQ(500.5, root.getSubtree("cam.K").get<double>("0"));
+  EXPECT_EQ("501", root.getRecord("cam.K.4").getValue());
+  EXPECT_EQ(240, root.getHandle<int>("cam.K.5").get());
+  EXPECT_FALSE(root.getOptional<double>("cam.K.9"));
+  EXPECT_THROW(root.get<int>("cam.K.0"), PropsError);
+
+  // writing an element turns the array into a key per element
+  root.set("cam.K.8", 2);
+  EXPECT_EQ(2, root.get<int>("cam.K.8"));
+  EXPECT_EQ(501, root.get<int>("cam.K.4"));
+  EXPECT_FALSE(root.getOptional<std::string>("cam.K"));
+  EXPECT_EQ(2.0, (*root.getArray<double>("cam.K"))[8]);
+  EXPECT_EQ(1.0, (*K)[8]);
+
+  // and a new array hides the keys of the old elements
+  std::vector<int> lut(4096);
+  for (size_t i = 0; i < lut.size(); ++i)
+    lut[i] = int(i * i % 255);
+  root.setArray("cam.K", std::vector<int>(2, 7));
+  root.setArray("lut", lut);
+  EXPECT_FALSE(root.getOptional<int>("cam.K.4"));
+  EXPECT_EQ(2u, root.getArray<int>("cam.K")->size());
+  EXPECT_EQ(lut, root.getArray<int>("lut")->toVector());
+  EXPECT_EQ(lut[4000], root.get<int>("lut.4000"));
+
+  // the loaders keep a key per element unless asked for arrays
+  std::vector<std::string> messages;
+  ASSERT_TRUE(load_from_json_text(root.getSubtree("plain"), messages,
+      "{ \"k\": [1, 2.5, 3], \"o\": { \"x\": 1 } }"));
+  keys.clear();
+  root.getSubtree("plain").listKeysRecursive(keys);
+  char const* const plainKeys[] = { "k.0", "k.1", "k.2", "o.x" };
+  EXPECT_EQ(std::vector<std::string>(plainKeys, plainKeys + 4), keys);
+  keys.clear();
+  root.getSubtree("plain.k").listKeys(keys);
+  char const* const elements[] = { "0", "1", "2" };
+  EXPECT_EQ(std::vector<std::string>(elements, elements + 3), keys);
+  EXPECT_FALSE(root.getOptional<std::string>("plain.k"));
+  EXPECT_EQ(2.5, (*root.getArray<double>("plain.k"))[1]);
+
+  ASSERT_TRUE(load_from_json_text(root.getSubtree("j"), messages,
+      "{ \"ints\": [1, 2, 3], \"reals\": [1, 2.5e0, -3], \"mixed\": [1, \"a\"],"
+      "  \"big\": [1, 12345678901], \"nested\": [[1], [2, 3]] }", true));
+  keys.clear();
+  root.getSubtree("j").listKeys(keys);
+  char const* const arrays[] = { "big", "ints", "mixed", "nested", "reals" };
+  EXPECT_EQ(std::vector<std::string>(arrays, arrays + 5), keys);
+  EXPECT_EQ("[1, 2, 3]", root.get<std::string>("j.ints"));
+  EXPECT_EQ(3u, root.getArray<int>("j.ints")->size());
+  EXPECT_TRUE(root.get<bool>("j.ints.0"));
+  EXPECT_EQ(-3.0, (*root.getArray<double>("j.reals"))[2]);
+  EXPECT_EQ("a", root.get<std::string>("j.mixed.1"));
+  EXPECT_FALSE(root.getArray<int>("j.mixed"));
+  EXPECT_EQ(12345678901LL, (*root.getArray<long long>("j.big"))[1]);
+  EXPECT_EQ(3, root.get<int>("j.nested.1.1"));
+
+  Json::Value doc(Json::objectValue);
+  doc["a"][0u] = 1;
+  doc["a"][1u] = 2.5;
+  ASSERT_TRUE(load_from_json(root.getSubtree("dom"), messages, doc, true));
+  EXPECT_EQ("[1, 2.5]", root.get<std::string>("dom.a"));
+  ASSERT_TRUE(load_from_json(root.getSubtree("dom2"), messages, doc));
+  EXPECT_EQ(2.5, root.get<double>("dom2.a.1"));
+  EXPECT_FALSE(root.getOptional<std::string>("dom2.a"));
+
+  // snapshots store a key per element
+  std::string const file = "mxprops_test_arrays.snapshot";
+  ASSERT_TRUE(save_snapshot(root.getSubtree("j"), messages, file));
+  SnapshotView view;
+  ASSERT_TRUE(view.open(file, messages));
+  EXPECT_EQ(2, view.get<int>("ints.1"));
+  PTree loaded;
+  ASSERT_TRUE(load_snapshot(loaded.root("r"), messages, file));
+  EXPECT_EQ(root.getArray<double>("j.reals")->toVector(), loaded.root("r").getArray<double>("reals")->toVector());
+  std::remove(file.c_str());
+}
+
 int main(int argc, char *argv[])
 {
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,285 @@
+/*
+Copyright (c) Visillect Service LLC. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of copyright holders.
+*/
+
+#pragma once
+
+#include <boost/optional.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/type_traits/is_signed.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <limits>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+# if __has_include(<charconv>)
+#  include <charconv>
+#  if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#   define MXPROPS_HAS_CHARCONV 1
+#  endif
+# endif
+#endif
+
+namespace mxprops {
+namespace detail {
+
+// Conversions of property values to numbers and back without streams,
+// locales or allocations (beyond the std::string of put_value). They
+// accept what the stream based translators of property_tree accept:
+// surrounding whitespace, an explicit '+', bool as 0/1/true/false.
+// Doubles are written in the shortest form that reads back exactly.
+
+inline bool isSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// trims whitespace, @return false if nothing is left
+inline bool trim(char const*& b, char const*& e)
+{
+  while (b != e && isSpace(*b))
+    ++b;
+  while (e != b && isSpace(e[-1]))
+    --e;
+  return b != e;
+}
+
+template <typename T>
+bool parseInteger(char const* b, char const* e, T & out)
+{
+  if (!trim(b, e))
+    return false;
+  if (*b == '+')
+    ++b;
+#ifdef MXPROPS_HAS_CHARCONV
+  std::from_chars_result const r = std::from_chars(b, e, out);
+  return r.ec == std::errc() && r.ptr == e;
+#else
+  bool const negative = boost::is_signed<T>::value && b != e && *b == '-';
+  if (negative)
+    ++b;
+  if (b == e)
+    return false;
+  // accumulated towards the sign, so that the minimum fits
+  T v = 0;
+  T const limit = negative ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+  for (; b != e; ++b)
+  {
+    if (*b < '0' || *b > '9')
+      return false;
+    T const d = T(*b - '0');
+    if (negative)
+    {
+      if (v < (limit + d) / 10)
+        return false;
+      v = v * 10 - d;
+    }
+    else
+    {
+      if (v > (limit - d) / 10)
+        return false;
+      v = v * 10 + d;
+    }
+  }
+  out = v;
+  return true;
+#endif
+}
+
+// @return the end of the written digits, buf must hold 24 characters
+template <typename T>
+char * formatInteger(char *buf, T v)
+{
+#ifdef MXPROPS_HAS_CHARCONV
+  return std::to_chars(buf, buf + 24, v).ptr;
+#else
+  char tmp[24];
+  char *p = tmp + sizeof(tmp);
+  bool const negative = v < T(0);
+  // digits of a negative number are taken towards zero, so that the minimum works
+  do
+  {
+    T const q = v / 10;
+    int const d = int(v - q * 10);
+    *--p = char('0' + (negative ? -d : d));
+    v = q;
+  } while (v != 0);
+  if (negative)
+    *--p = '-';
+  size_t const n = tmp + sizeof(tmp) - p;
+  std::memcpy(buf, p, n);
+  return buf + n;
+#endif
+}
+
+inline bool parseBool(char const* b, char const* e, bool & out)
+{
+  if (!trim(b, e))
+    return false;
+  boost::string_ref const s(b, e - b);
+  if (s == "1" || s == "true")
+    out = true;
+  else if (s == "0" || s == "false")
+    out = false;
+  else
+    return false;
+  return true;
+}
+
+#ifdef MXPROPS_HAS_CHARCONV
+
+template <typename T>
+bool parseFloat(char const* b, char const* e, T & out)
+{
+  if (!trim(b, e))
+    return false;
+  if (*b == '+')
+    ++b;
+  std::from_chars_result const r = std::from_chars(b, e, out);
+  return r.ec == std::errc() && r.ptr == e;
+}
+
+// Shortest round-trip digits, laid out like the streams do by default:
+// fixed unless the exponent is below -4 or beyond the precision.
+// @return the end of the written characters, buf must hold 64 characters
+template <typename T>
+char * formatFloat(char *buf, T v)
+{
+  std::to_chars_result const sci = std::to_chars(buf, buf + 64, v, std::chars_format::scientific);
+  char const* const exp = std::find(buf, sci.ptr, 'e');
+  if (exp == sci.ptr)
+    return sci.ptr;  // inf or nan
+  int e = 0;
+  std::from_chars(exp + (exp[1] == '+' ? 2 : 1), sci.ptr, e);
+  if (e < -4 || e > std::numeric_limits<T>::digits10)
+    return sci.ptr;
+  return std::to_chars(buf, buf + 64, v, std::chars_format::fixed).ptr;
+}
+
+#endif
+
+template <typename T>
+struct IntegerTranslator
+{
+  typedef std::string internal_type;
+  typedef T external_type;
+
+  boost::optional<T> get_value(std::string const& s) const
+  {
+    T v;
+    if (parseInteger(s.data(), s.data() + s.size(), v))
+      return v;
+    return boost::optional<T>();
+  }
+
+  boost::optional<std::string> put_value(T const& v) const
+  {
+    char buf[24];
+    return std::string(buf, formatInteger(buf, v));
+  }
+};
+
+#ifdef MXPROPS_HAS_CHARCONV
+
+template <typename T>
+struct FloatTranslator
+{
+  typedef std::string internal_type;
+  typedef T external_type;
+
+  boost::optional<T> get_value(std::string const& s) const
+  {
+    T v;
+    if (parseFloat(s.data(), s.data() + s.size(), v))
+      return v;
+    return boost::optional<T>();
+  }
+
+  boost::optional<std::string> put_value(T const& v) const
+  {
+    char buf[64];
+    return std::string(buf, formatFloat(buf, v));
+  }
+};
+
+#endif
+
+struct BoolTranslator
+{
+  typedef std::string internal_type;
+  typedef bool external_type;
+
+  boost::optional<bool> get_value(std::string const& s) const
+  {
+    bool v;
+    if (parseBool(s.data(), s.data() + s.size(), v))
+      return v;
+    return boost::optional<bool>();
+  }
+
+  boost::optional<std::string> put_value(bool v) const
+  {
+    return std::string(v ? "true" : "false");
+  }
+};
+
+// the translator used for property values of type T
+template <typename T>
+struct Translator
+{
+  typedef typename boost::property_tree::translator_between<std::string, T>::type type;
+};
+
+#define MXPROPS_TRANSLATOR(T, Tr)                                 \
+template <>                                                       \
+struct Translator<T>                                              \
+{                                                                 \
+  typedef Tr type;                                                \
+}
+
+// not the character types, which streams read as characters
+MXPROPS_TRANSLATOR(short, IntegerTranslator<short>);
+MXPROPS_TRANSLATOR(unsigned short, IntegerTranslator<unsigned short>);
+MXPROPS_TRANSLATOR(int, IntegerTranslator<int>);
+MXPROPS_TRANSLATOR(unsigned, IntegerTranslator<unsigned>);
+MXPROPS_TRANSLATOR(long, IntegerTranslator<long>);
+MXPROPS_TRANSLATOR(unsigned long, IntegerTranslator<unsigned long>);
+MXPROPS_TRANSLATOR(long long, IntegerTranslator<long long>);
+MXPROPS_TRANSLATOR(unsigned long long, IntegerTranslator<unsigned long long>);
+MXPROPS_TRANSLATOR(bool, BoolTranslator);
+#ifdef MXPROPS_HAS_CHARCONV
+MXPROPS_TRANSLATOR(float, FloatTranslator<float>);
+MXPROPS_TRANSLATOR(double, FloatTranslator<double>);
+#endif
+
+#undef MXPROPS_TRANSLATOR
+
+} // namespace detail
+} // namespace mxprops